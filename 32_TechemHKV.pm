@@ -14,6 +14,7 @@ use strict;
 use warnings;
 
 use Time::HiRes qw(time);
+use TechemUtils;
 
 my %typeText = (
   '80' => 'Funkheizkostenverteiler data III'
@@ -119,45 +120,31 @@ TechemHKV_Receive(@) {
   
   $hash->{VERSION} = $msg->{version};
   $hash->{METER} = $typeText{$msg->{type}};
-  delete $hash->{CHANGETIME}; # clean up, workaround for fhem prior http://forum.fhem.de/index.php/topic,47474.msg391964.html#msg391964
+  my @r;
   
   if (($msg->{version} || '') =~ /69|94/) {
-    readingsBeginUpdate($hash);
-    readingsBulkUpdate($hash, "temp1", $msg->{temp1});
-    readingsBulkUpdate($hash, "temp2", $msg->{temp2});
-    readingsEndUpdate($hash, 1);
+    push @r, ["temp1", $msg->{temp1}], ["temp2", $msg->{temp2}];
   };
 
   # day period changed
   $ats = ReadingsTimestamp($hash->{NAME},"current_period", "0");
   $ts = sprintf ("%02d-%02d-%02d 00:00:00", $msg->{actual}->{year}, $msg->{actual}->{month}, $msg->{actual}->{day});
   if ($ats ne $ts) {
-    my $i;
-    readingsBeginUpdate($hash);
-    $hash->{".updateTimestamp"} = $ts;
-    $i = $#{ $hash->{CHANGED} };
-    readingsBulkUpdate($hash, "current_period", $msg->{actualVal});
+    push @r, ["current_period", $msg->{actualVal}, $ts];
     # new: always save history along with current period
-    readingsBulkUpdate($hash, "history", $msg->{history});
-    readingsBulkUpdate($hash, "rssi", $msg->{rssi}  );
-    readingsBulkUpdate($hash, "debug", $msg->{debug} ) ;
-
-    $hash->{CHANGETIME}->[$#{ $hash->{CHANGED} }] = $ts if ($#{ $hash->{CHANGED} } != $i ); # only add ts if there is a event to
-    readingsEndUpdate($hash, 1);
+    push @r, ["history", $msg->{history}, $ts];
+    push @r, ["rssi", $msg->{rssi}, $ts];
+    push @r, ["debug", $msg->{debug}, $ts];
   };
 
   # billing period changed
   $ats = ReadingsTimestamp($hash->{NAME},"previous_period", "0");
   $ts = sprintf ("20%02d-%02d-%02d 00:00:00", $msg->{last}->{year}, $msg->{last}->{month}, $msg->{last}->{day});
   if ($ats ne $ts) {
-    my $i;
-    readingsBeginUpdate($hash);
-    $hash->{".updateTimestamp"} = $ts;
-    $i = $#{ $hash->{CHANGED} };
-    readingsBulkUpdate($hash, "previous_period", $msg->{lastVal});
-    $hash->{CHANGETIME}->[$#{ $hash->{CHANGED} }] = $ts if ($#{ $hash->{CHANGED} } != $i ); # only add ts if there is a event to
-    readingsEndUpdate($hash, 1);
+    push @r, ["previous_period", $msg->{lastVal}, $ts];
   };
+
+  TechemUtils_Commit($hash, @r);
   return undef;
 };
 
@@ -189,10 +176,20 @@ sub
 TechemHKV_Parse(@) {
 
   my ($iohash, $msg) = @_;
+  my $message = TechemHKV_Decode($msg);
+  return ('') unless $message;
+  return TechemHKV_Dispatch($iohash, $message);
+}
+
+# decode a telegram, uses no device state (may run in a ParsePool worker)
+sub
+TechemHKV_Decode(@) {
+
+  my ($msg) = @_;
   my ($message, $rssi);
   ($msg, $rssi) = split (/::/, $msg);
   $msg = TechemHKV_SanityCheck($msg);
-  return ('') unless $msg;
+  return undef unless $msg;
   
   $message->{long} = join '', reverse split /(..)/, substr $msg, 6, 8;
   $message->{short} = substr $message->{long}, 4, 4;
@@ -255,6 +252,14 @@ TechemHKV_Parse(@) {
   } elsif ($message->{version} eq '69') {
     $message->{temp2} = sprintf "%.2f", (hex(join '', reverse split /(..)/, substr $msg, 42, 4) / 100);
   }
+
+  return $message;
+}
+
+sub
+TechemHKV_Dispatch(@) {
+
+  my ($iohash, $message) = @_;
   
   # dispatch
   if (exists($modules{TechemHKV}{defptr}{$message->{long}})) {
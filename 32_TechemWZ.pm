@@ -14,6 +14,7 @@ use strict;
 use warnings;
 
 use Time::HiRes qw(time);
+use TechemUtils;
 
 my %typeText = (
   '62' => 'warm water',   # 
@@ -140,39 +141,26 @@ TechemWZ_Receive(@) {
   
   $hash->{VERSION} = $msg->{version};
   $hash->{METER} = $typeText{$msg->{type}};
-  delete $hash->{CHANGETIME}; # clean up, workaround for fhem prior http://forum.fhem.de/index.php/topic,47474.msg391964.html#msg391964
+  my @r;
 
   # day period changed
   $ats = ReadingsTimestamp($hash->{NAME},"current_period", "0");
   $ts = sprintf ("%02d-%02d-%02d 00:00:00", $msg->{actual}->{year}, $msg->{actual}->{month}, $msg->{actual}->{day});
   if ($ats ne $ts) {
-    my $i;
-    readingsBeginUpdate($hash);
-    $hash->{".updateTimestamp"} = $ts;
-    $i = $#{ $hash->{CHANGED} };
-    readingsBulkUpdate($hash, "meter", $msg->{meter});
-    $hash->{CHANGETIME}->[$#{ $hash->{CHANGED} }] = $ts if ($#{ $hash->{CHANGED} } != $i ); # only add ts if there is a event to
-    $i = $#{ $hash->{CHANGED} };
-    readingsBulkUpdate($hash, "current_period", $msg->{actualVal});
+    push @r, ["meter", $msg->{meter}, $ts];
+    push @r, ["current_period", $msg->{actualVal}, $ts];
     # new: always save history along with current period
-    readingsBulkUpdate($hash, "history", $msg->{history});
-    $hash->{CHANGETIME}->[$#{ $hash->{CHANGED} }] = $ts if ($#{ $hash->{CHANGED} } != $i ); # only add ts if there is a event to
-    readingsEndUpdate($hash, 1);
+    push @r, ["history", $msg->{history}, $ts];
   }
 
   # billing period changed
   $ats = ReadingsTimestamp($hash->{NAME},"previous_period", "0");
   $ts = sprintf ("20%02d-%02d-%02d 00:00:00", $msg->{last}->{year}, $msg->{last}->{month}, $msg->{last}->{day});
   if ($ats ne $ts) {
-    my $i;
-    readingsBeginUpdate($hash);
-    $hash->{".updateTimestamp"} = $ts;
-    $i = $#{ $hash->{CHANGED} };
-    readingsBulkUpdate($hash, "previous_period", $msg->{lastVal});
-    $hash->{CHANGETIME}->[$#{ $hash->{CHANGED} }] = $ts if ($#{ $hash->{CHANGED} } != $i ); # only add ts if there is a event to
-    readingsEndUpdate($hash, 1);
+    push @r, ["previous_period", $msg->{lastVal}, $ts];
   }
 
+  TechemUtils_Commit($hash, @r);
   return undef;
 }
 
@@ -204,13 +192,22 @@ sub
 TechemWZ_Parse(@) {
 
   my ($iohash, $msg) = @_;
+  my $message = TechemWZ_Decode($msg);
+  return '' unless $message;
+  return TechemWZ_Dispatch($iohash, $message);
+}
+
+# decode a telegram, uses no device state (may run in a ParsePool worker)
+sub
+TechemWZ_Decode(@) {
+
+  my ($msg) = @_;
   my ($message, $rssi);
   ($msg, $rssi) = split (/::/, $msg);
   $msg = TechemWZ_SanityCheck($msg);
-  return '' unless $msg; 
+  return undef unless $msg; 
 
   my @m = ($msg =~ m/../g);
-  my @d;
 
   # parse
   ($message->{long}, $message->{short}) = TechemWZ_ParseID(@m);
@@ -238,6 +235,15 @@ TechemWZ_Parse(@) {
     ($message->{last}->{year}, $message->{last}->{month}, $message->{last}->{day}) = TechemWZ_ParseLastDate(@m);
     $message->{meter} = $message->{lastVal} + $message->{actualVal};
   }
+
+  return $message;
+}
+
+sub
+TechemWZ_Dispatch(@) {
+
+  my ($iohash, $message) = @_;
+  my @d;
   
   # list
   if (exists( $modules{TechemWZ}{defptr}{'00000000'} ) && defined( $defs{$modules{TechemWZ}{defptr}{'00000000'}->{NAME}} )) { 
@@ -20,6 +20,7 @@ package main;
 
 use strict;
 use warnings;
+use Time::Local;
 
 my %codes = (
   "01.e" => "ESAx000WZ",
@@ -27,6 +28,31 @@ my %codes = (
   "cc.e" => "GIRAEHZ",
 );
 
+# Unknown device codes (neighbours) are reported once per TTL, repeats are
+# only counted and summarized every ESA2000_UNKNOWN_LOG seconds.
+use constant ESA2000_UNKNOWN_TTL => 3600;
+use constant ESA2000_UNKNOWN_LOG => 900;
+
+# readings written by Dispatch, see the numbers there
+my @readings = ( "repeat", "sequence", "total_ticks", "actual_ticks", "ticks",
+             "raw", "total", "actual", "diff", "diff_sec", "diff_ticks",
+             "last_sec", "raw_total", "max", "day", "month", "year", "rate",
+             "day_hr", "day_lr", "month_hr", "month_lr", "year_hr", "year_lr",
+             "day_last", "month_last", "year_last", "hour", "hour_last",
+             "battery" );
+
+# Rollup rings of actual and total: resolution => [seconds per bucket,
+# buckets, default count of get]. A ring is one string of packed doubles,
+# a bucket is start, min, max, sum, count, last (48 bytes), its slot is
+# start/seconds modulo the ring size, so a message updates one bucket per
+# resolution. Longer minute series are in the log.
+my %rollup = (
+  "minute" => [    60,  180, 60 ],
+  "hour"   => [  3600,  744, 24 ],
+  "day"    => [ 86400,  732, 31 ],
+);
+my $rollupsz = 6 * 8;
+
 
 #####################################
 sub
@@ -42,6 +68,8 @@ ESA2000_Initialize($)
   $hash->{DefFn}     = "ESA2000_Define";
   $hash->{UndefFn}   = "ESA2000_Undef";
   $hash->{ParseFn}   = "ESA2000_Parse";
+  $hash->{GetFn}     = "ESA2000_Get";
+  $hash->{NotifyFn}  = "ESA2000_Notify";
   $hash->{AttrList}  = "IODev do_not_notify:0,1 showtime:0,1 ignore:0,1 ".
                        "model:esa2000-led,esa2000-wz,esa2000-s0,esa1000wz-ir,esa1000wz-s0,esa1000wz-led,esa1000gas,gira-ehz base_1 base_2 ".
                        $readingFnAttributes;
@@ -61,7 +89,9 @@ ESA2000_Define($$)
 
 
   $hash->{CODE} = $a[2];
+  $hash->{NOTIFYDEV} = $a[0];                   # setreading, see ESA2000_Cache
   $modules{ESA2000}{defptr}{$a[2]} = $hash;
+  delete($modules{ESA2000}{unknown}{$a[2]});
   AssignIoPort($hash);
   return undef;
 }
@@ -77,6 +107,168 @@ ESA2000_Undef($$)
   return undef;
 }
 
+#####################################
+# Negative cache for undefined codes: returns 1 if $dev was already
+# reported within ESA2000_UNKNOWN_TTL, the frame is then only counted.
+# The summary is logged with the verbose level of the IO device.
+sub
+ESA2000_Unknown($$)
+{
+  my ($iohash, $dev) = @_;
+  my $now = time();
+  my $u = $modules{ESA2000}{unknown}{$dev};
+
+  if(defined($u) && $now - $u->{first} < ESA2000_UNKNOWN_TTL) {
+    $u->{count}++;
+    $u->{last} = $now;
+    $u->{io} = $iohash->{NAME};
+    return 1;
+  }
+
+  $modules{ESA2000}{unknown}{$dev} = { first => $now, last => $now, count => 0,
+                                       io => $iohash->{NAME} };
+  if(!$modules{ESA2000}{unknownTimer}) {
+    $modules{ESA2000}{unknownTimer} = 1;
+    InternalTimer($now + ESA2000_UNKNOWN_LOG, "ESA2000_UnknownSummary", "ESA2000", 0);
+  }
+  return 0;
+}
+
+#####################################
+sub
+ESA2000_UnknownSummary($)
+{
+  my $now = time();
+  my $u = $modules{ESA2000}{unknown};
+  my %l;
+
+  foreach my $dev (sort keys %{$u}) {
+    push(@{$l{$u->{$dev}{io}}}, "$dev:$u->{$dev}{count}") if($u->{$dev}{count});
+    $u->{$dev}{count} = 0;
+    delete($u->{$dev}) if($now - $u->{$dev}{last} >= ESA2000_UNKNOWN_TTL);
+  }
+  foreach my $io (sort keys %l) {
+    Log3 $io, 3, "ESA2000: frames of unknown devices dropped (code:count) ".
+                 join(" ", @{$l{$io}});
+  }
+
+  if(%{$u}) {
+    InternalTimer($now + ESA2000_UNKNOWN_LOG, "ESA2000_UnknownSummary", "ESA2000", 0);
+  } else {
+    $modules{ESA2000}{unknownTimer} = 0;
+  }
+}
+
+#####################################
+# Values and times of the readings used by Parse, as { name => [VAL, TIME] }.
+# Seeded from READINGS (restored from the statefile), then kept in sync by
+# Parse. A setreading outside of Parse drops it in the NotifyFn; a deleted
+# reading or a corrected total (with or without an event) changes the
+# sentinel: then it is seeded again.
+sub
+ESA2000_Cache($)
+{
+  my ($def) = @_;
+  my $c = $def->{helper}{r};
+
+  return $c if(defined($c) && $def->{helper}{rs} eq ESA2000_Sentinel($def));
+
+  my $rd = $def->{READINGS};
+  my %r;
+  foreach my $k (@readings) {
+    $r{$k} = [ $rd->{$k}{VAL}, $rd->{$k}{TIME} ] if(defined($rd->{$k}));
+  }
+  $def->{helper}{rs} = ESA2000_Sentinel($def);
+  return $def->{helper}{r} = \%r;
+}
+
+sub
+ESA2000_Sentinel($)
+{
+  my ($def) = @_;
+  my $rd = $def->{READINGS} || {};
+  my $t = $rd->{total};
+  return scalar(keys %{$rd}).(defined($t) ? ",$t->{TIME},$t->{VAL}" : "");
+}
+
+#####################################
+sub
+ESA2000_Notify($$)
+{
+  my ($hash, $dev) = @_;
+  delete($hash->{helper}{r}) if(!$hash->{helper}{parse});
+  return undef;
+}
+
+#####################################
+# Add the values of one message to the rollup rings. Buckets are aligned to
+# local time, a slot holding an older bucket is started again.
+sub
+ESA2000_Rollup($$$$)
+{
+  my ($def, $t, $actual, $total) = @_;
+  my @lt = localtime($t);
+  my $off = timegm(@lt[0..5]) - $t;
+  my %val = ( "actual" => $actual, "total" => $total );
+
+  foreach my $s (keys %val) {
+    my $x = $val{$s};
+    next if(!defined($x) || ($s eq "actual" && $x < 0));
+    foreach my $res (keys %rollup) {
+      my ($step, $n) = @{$rollup{$res}};
+      my $start = $t - ($t + $off) % $step;
+      my $r = $def->{helper}{rollup}{$s} ||= {};
+      $r->{$res} = "\0" x ($n * $rollupsz) if(!defined($r->{$res}));
+      my $o = (int(($start + $off) / $step) % $n) * $rollupsz;
+      my @bu = unpack("d6", substr($r->{$res}, $o, $rollupsz));
+      if($bu[0] != $start) {
+        @bu = ( $start, $x, $x, 0, 0, $x );
+      }
+      $bu[1] = $x if($x < $bu[1]);
+      $bu[2] = $x if($x > $bu[2]);
+      $bu[3] += $x;
+      $bu[4]++;
+      $bu[5] = $x;
+      substr($r->{$res}, $o, $rollupsz, pack("d6", @bu));
+    }
+  }
+}
+
+#####################################
+sub
+ESA2000_Get($@)
+{
+  my ($hash, $name, $cmd, @a) = @_;
+  my $res = join("|", sort keys %rollup);
+
+  return "Unknown argument $cmd, choose one of rollup"
+        if(!defined($cmd) || $cmd ne "rollup");
+  return "Usage: get $name rollup <actual|total> <$res> [count]"
+        if(int(@a) < 2 || $a[0] !~ m/^(actual|total)$/ || !$rollup{$a[1]} ||
+           (defined($a[2]) && $a[2] !~ m/^\d+$/));
+
+  my ($step, $n, $cnt) = @{$rollup{$a[1]}};
+  $cnt = $a[2] if(defined($a[2]));
+  $cnt = $n if($cnt > $n);
+  my $ring = $hash->{helper}{rollup}{$a[0]}{$a[1]};
+  return "no $a[0] values yet" if(!defined($ring));
+
+  # newest bucket first, a slot belongs to the requested period only if
+  # its start matches (otherwise it is older or was never written)
+  my $t = time();
+  my @lt = localtime($t);
+  my $off = timegm(@lt[0..5]) - $t;
+  my $start = $t - ($t + $off) % $step;
+  my @l = ( "start min max avg sum count last" );
+  for(my $i = 0; $i < $cnt; $i++, $start -= $step) {
+    my @bu = unpack("d6", substr($ring, (int(($start + $off) / $step) % $n) * $rollupsz, $rollupsz));
+    next if($bu[0] != $start);
+    push(@l, sprintf("%s %.3f %.3f %.3f %.3f %d %.3f", FmtDateTime($bu[0]),
+                     $bu[1], $bu[2], $bu[3]/$bu[4], $bu[3], $bu[4], $bu[5]));
+  }
+  return join("\n", @l);
+}
+
 #####################################
 sub
 ESA2000_Parse($$)
@@ -107,27 +299,51 @@ ESA2000_Parse($$)
 # S 6E 003D 011E 00037650 0011 02C1DA 07D0     ESA1000WZ_S0     Zhlerkonstante = 2000
 # S A3 0543 031E 0000099C 0064 001147 000F     ESA1000GAS       Zhlerkonstante = 10
 # S 2B 225F CC1E 04 00A0 002F65 0001 00000000 42 GIRAEHZ        Zhlerkonstante = 96
-  $msg = lc($msg);
-  my $seq = substr($msg, 1, 2);
-  my $dev = substr($msg, 3, 4);
-  my $cde = substr($msg, 7, 4);
-  my $val = substr($msg, 11, 22);
+  return ESA2000_Dispatch($hash, ESA2000_Decode($msg));
+}
 
-  Log3 $hash, 5, "ESA2000 msg $msg";
-  Log3 $hash, 5, "ESA2000 seq $seq";
-  Log3 $hash, 5, "ESA2000 device $dev";
-  Log3 $hash, 5, "ESA2000 code $cde";
+#####################################
+# split the message, uses no device state (may run in a ParsePool worker)
+sub
+ESA2000_Decode($)
+{
+  my ($msg) = @_;
 
-  my $type = "$cde";
+  $msg = lc($msg);
+  my %m = (
+    msg => $msg,
+    seq => substr($msg, 1, 2),
+    dev => substr($msg, 3, 4),
+    cde => substr($msg, 7, 4),
+    val => substr($msg, 11, 22),
+  );
+
+  $m{type} = $m{cde};
   foreach my $c (keys %codes) {
     $c = lc($c);
-    if($cde =~ m/$c/) {
-      $type = $codes{$c};
+    if($m{cde} =~ m/$c/) {
+      $m{type} = $codes{$c};
       last;
     }
   }
+  return \%m;
+}
+
+#####################################
+sub
+ESA2000_Dispatch($$)
+{
+  my ($hash, $m) = @_;
+  my ($msg, $seq, $dev, $cde, $val, $type) =
+        @{$m}{qw(msg seq dev cde val type)};
+
+  Log3 $hash, 5, "ESA2000 msg $msg";
+  Log3 $hash, 5, "ESA2000 seq $seq";
+  Log3 $hash, 5, "ESA2000 device $dev";
+  Log3 $hash, 5, "ESA2000 code $cde";
 
   if(!defined($modules{ESA2000}{defptr}{$dev})) {
+    return "" if(ESA2000_Unknown($hash, $dev));
     Log3 $hash, 3, "Unknown ESA2000 device $dev, please define it";
     $type = "ESA2000" if(!$type);
     return "UNDEFINED ${type}_$dev ESA2000 $dev";
@@ -138,6 +354,7 @@ ESA2000_Parse($$)
   return "" if(IsIgnored($name));
 
   my $now = TimeNow();
+  my $r = ESA2000_Cache($def);
   my (@v, @txt);
 
 #  ($sec,$min,$hour,$mday,$mon,$year,$wday,$yday,$isdst) = gmtime(time);
@@ -152,12 +369,7 @@ ESA2000_Parse($$)
 
   if(($type eq "ESAx000WZ") || ($type eq "ESA1000Z") || ($type eq "GIRAEHZ")) {
 
-    @txt = ( "repeat", "sequence", "total_ticks", "actual_ticks", "ticks", 
-             "raw", "total", "actual", "diff", "diff_sec", "diff_ticks", 
-             "last_sec", "raw_total", "max", "day", "month", "year", "rate", 
-             "day_hr", "day_lr", "month_hr", "month_lr", "year_hr", "year_lr", 
-             "day_last", "month_last", "year_last", "hour", "hour_last", 
-             "battery" );
+    @txt = @readings;
 #   if ( $type eq "GIRAEHZ") 
 #             { push(@txt,"power") ; }   # add "power" to list of parameters
 
@@ -205,13 +417,13 @@ ESA2000_Parse($$)
                          $v[1], $v[0], $v[2], $v[3], $v[4], $v[17] );
 
     $v[11] = time();
-    $v[9] =  $v[11] - (defined($def->{READINGS}{$txt[11]}{VAL}) ? $def->{READINGS}{$txt[11]}{VAL} : $v[11]); # seconds since last update
+    $v[9] =  $v[11] - (defined($r->{$txt[11]}[0]) ? $r->{$txt[11]}[0] : $v[11]); # seconds since last update
 
     $v[7] = -1;
     $v[8] = sprintf("%.4f", $v[3]/$v[4]/$corr);    # calculate kWh diff from readings (raw from device....), whats this relly?
 
-    if(defined($def->{READINGS}{$txt[2]}{VAL}) && $def->{READINGS}{$txt[2]}{VAL} <=$v[2]) {    # check for resetted counter.... only accept increase in counter
-      $v[10] = $v[2] - $def->{READINGS}{$txt[2]}{VAL};                                         # should be the same as actual_ticks if no packets are lost
+    if(defined($r->{$txt[2]}[0]) && $r->{$txt[2]}[0] <=$v[2]) {    # check for resetted counter.... only accept increase in counter
+      $v[10] = $v[2] - $r->{$txt[2]}[0];                                         # should be the same as actual_ticks if no packets are lost
     }
 
     if(defined($v[10])) {
@@ -221,12 +433,12 @@ ESA2000_Parse($$)
         # $v[9] = (($v[9] lt 110) ? 150 : $v[9]);
         $v[7] = $con/$v[9]*3600;                                        # calculate kW/h since last update
       }
-      $v[6] = $con + (defined($def->{READINGS}{$txt[6]}{VAL}) ? $def->{READINGS}{$txt[6]}{VAL} : 0); # cumulate kWh to ensure tick-changes are calculated correctly (does this ever happen?)
+      $v[6] = $con + (defined($r->{$txt[6]}[0]) ? $r->{$txt[6]}[0] : 0); # cumulate kWh to ensure tick-changes are calculated correctly (does this ever happen?)
       # 27 "hour"
       # 28 "hour_last"
-      if(defined($def->{READINGS}{$txt[27]}{VAL})) {
-        $v[27] = $con + ((substr($now,0,13) eq substr($def->{READINGS}{$txt[27]}{TIME},0,13)) ? $def->{READINGS}{$txt[27]}{VAL} : 0);
-        $v[28] = $def->{READINGS}{$txt[27]}{VAL} if(substr($now,0,13) ne substr($def->{READINGS}{$txt[27]}{TIME},0,13));
+      if(defined($r->{$txt[27]}[0])) {
+        $v[27] = $con + ((substr($now,0,13) eq substr($r->{$txt[27]}[1],0,13)) ? $r->{$txt[27]}[0] : 0);
+        $v[28] = $r->{$txt[27]}[0] if(substr($now,0,13) ne substr($r->{$txt[27]}[1],0,13));
       } else {
         $v[27] = $con
       }
@@ -236,24 +448,24 @@ ESA2000_Parse($$)
       # 19 "day_lr"      # 21 "month_lr"      # 23 "year_lr"
       # 24 "day_last"    # 25 "month_last"    # 26 "year_last"
       for(my $i = 0; $i < 3; $i++) {
-        if(defined($def->{READINGS}{$txt[$i+14]}{VAL})) {
-          $v[14+$i] = $con + ((substr($now,0,10-$i*3) eq substr($def->{READINGS}{$txt[$i+14]}{TIME},0,10-$i*3)) ? $def->{READINGS}{$txt[14+$i]}{VAL} : 0);
-          $v[24+$i] = $def->{READINGS}{$txt[14+$i]}{VAL} if(substr($now,0,10-$i*3) ne substr($def->{READINGS}{$txt[$i+14]}{TIME},0,10-$i*3));
+        if(defined($r->{$txt[$i+14]}[0])) {
+          $v[14+$i] = $con + ((substr($now,0,10-$i*3) eq substr($r->{$txt[$i+14]}[1],0,10-$i*3)) ? $r->{$txt[14+$i]}[0] : 0);
+          $v[24+$i] = $r->{$txt[14+$i]}[0] if(substr($now,0,10-$i*3) ne substr($r->{$txt[$i+14]}[1],0,10-$i*3));
         } else {
           $v[14+$i] = $con
         }
         if ($v[17] eq "HR" ) {
           # high-rate
-          $v[18+2*$i] = $con + (defined($def->{READINGS}{$txt[18+2*$i]}{VAL}) && (substr($now,0,10-3*$i) eq substr($def->{READINGS}{$txt[18+2*$i]}{TIME},0,10-3*$i)) ? $def->{READINGS}{$txt[18+2*$i]}{VAL} : 0);
+          $v[18+2*$i] = $con + (defined($r->{$txt[18+2*$i]}[0]) && (substr($now,0,10-3*$i) eq substr($r->{$txt[18+2*$i]}[1],0,10-3*$i)) ? $r->{$txt[18+2*$i]}[0] : 0);
         } else {
           # low-rate
-          $v[19+2*$i] = $con + (defined($def->{READINGS}{$txt[19+2*$i]}{VAL}) && (substr($now,0,10-3*$i) eq substr($def->{READINGS}{$txt[19+2*$i]}{TIME},0,10-3*$i)) ? $def->{READINGS}{$txt[19+2*$i]}{VAL} : 0);
+          $v[19+2*$i] = $con + (defined($r->{$txt[19+2*$i]}[0]) && (substr($now,0,10-3*$i) eq substr($r->{$txt[19+2*$i]}[1],0,10-3*$i)) ? $r->{$txt[19+2*$i]}[0] : 0);
         }
       }
 
-      if(!defined($def->{READINGS}{$txt[13]}{VAL})) {
+      if(!defined($r->{$txt[13]}[0])) {
         $v[13] = $v[7];    # update max kw/h
-      } elsif($v[7] >= $def->{READINGS}{$txt[13]}{VAL}) {
+      } elsif($v[7] >= $r->{$txt[13]}[0]) {
         $v[13] = $v[7];    # update max kw/h
       }
 
@@ -270,7 +482,7 @@ ESA2000_Parse($$)
 
     } else {
       #  6 "total_kwh"
-      $v[6] = (defined($def->{READINGS}{$txt[6]}{VAL}) ? $def->{READINGS}{$txt[6]}{VAL} : 0);
+      $v[6] = (defined($r->{$txt[6]}[0]) ? $r->{$txt[6]}[0] : 0);
     }
 
     $val = sprintf("CNT: %d%s CUM: %0.3f CUR: %0.3f TICKS: %d %s",
@@ -279,17 +491,21 @@ ESA2000_Parse($$)
   #
   # from here readings are effectively updated
   #
+  $def->{helper}{parse} = 1;
   readingsBeginUpdate($def);
 
   Log3 $name, 4, "ESA2000 $name: $val";
 
-  if ( (defined($def->{READINGS}{"sequence"}{VAL}) ? $def->{READINGS}{"sequence"}{VAL} : "") ne $v[1] ) {
+  if ( (defined($r->{sequence}[0]) ? $r->{sequence}[0] : "") ne $v[1] ) {
     my $max = int(@txt);
+    my $ts = defined($def->{".updateTimestamp"}) ? $def->{".updateTimestamp"} : $now;
     for( my $i = 0; $i < $max; $i++) {
       if (defined($v[$i])) {
         readingsBulkUpdate($def, $txt[$i], $v[$i]);
+        $r->{$txt[$i]} = [ $v[$i], $ts ];
       }
     }
+    ESA2000_Rollup($def, $v[11], $v[7], $v[6]);
   #   add power event for GIRA-EHZ, if power > 0 (suppresses bad readings at low power)
     if ( $type eq "GIRAEHZ" && $v[30] > 0 )  {
               readingsBulkUpdate($def, "power", $v[30]);
@@ -305,6 +521,8 @@ ESA2000_Parse($$)
   # now we are done with updating readings
   #
   readingsEndUpdate($def, 1);
+  delete($def->{helper}{parse});
+  $def->{helper}{rs} = ESA2000_Sentinel($def);
 
   return $name;
 }
@@ -328,6 +546,10 @@ ESA2000_Parse($$)
     <br>
     &lt;code&gt; is the 4 digit HEX code identifying the devices.<br><br>
 
+    Messages of an undefined code are reported (log and autocreate) once
+    per hour; repeats are dropped and summarized in the log every 15
+    minutes.<br><br>
+
     <b>base1/2</b> is added to the total kwh as a base (Hoch- und Niedertarifz&auml;hlerstand).
   </ul>
   <br>
@@ -336,7 +558,17 @@ ESA2000_Parse($$)
   <b>Set</b> <ul>N/A</ul><br>
 
   <a name="ESA2000get"></a>
-  <b>Get</b> <ul>N/A</ul><br>
+  <b>Get</b>
+  <ul>
+    <code>get &lt;name&gt; rollup &lt;actual|total&gt; &lt;minute|hour|day&gt; [count]</code><br>
+    Lists min, max, avg, sum, count and the last value of actual (kW) or
+    total (kWh) per minute, hour or day, newest first, without reading the
+    logs. The buckets are updated with every message and kept for 3 hours
+    (minute), 31 days (hour) and 2 years (day); count defaults to 60, 24
+    and 31. The consumption of a bucket is max - min of total.<br>
+    The buckets are kept in memory only, a <a href="#StateSnapshot">StateSnapshot</a>
+    device saves them across restarts.
+  </ul><br>
 
   <a name="ESA2000attr"></a>
   <b>Attributes</b>
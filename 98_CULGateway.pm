@@ -0,0 +1,430 @@
+###############################################################################
+# $Id: 98_CULGateway.pm $
+#
+# this module is part of fhem under the same license
+#
+# receive culfw messages through contrib/cul_gateway and a shared memory ring
+#
+# history
+# initial checkin
+#
+###############################################################################
+package main;
+
+use strict;
+use warnings;
+
+use Config;
+use Fcntl;
+use POSIX;
+use File::Basename;
+
+# layout as in contrib/cul_shmring.h
+use constant {
+  CULGW_MAGIC   => 0x52485343,
+  CULGW_VERSION => 1,
+  CULGW_HDRSIZE => 4096,
+  CULGW_HEAD    => 64,        # head dropped badlines
+  CULGW_TAIL    => 128,
+  CULGW_F_NIBBLE=> 0x01,
+  CULGW_F_RAW   => 0x02,
+  CULGW_F_RSSI  => 0x04,
+  CULGW_CHECK   => 10,        # seconds between checks of the gateway process
+};
+
+sub
+CULGateway_Initialize(@) {
+  my ($hash) = @_;
+
+  $hash->{DefFn}      = "CULGateway_Define";
+  $hash->{UndefFn}    = "CULGateway_Undef";
+  $hash->{SetFn}      = "CULGateway_Set";
+  $hash->{NotifyFn}   = "CULGateway_Notify";
+  $hash->{ReadFn}     = "CULGateway_Read";
+
+  $hash->{AttrList}   = "disable:0,1 gateway shm initCommands rssi:0,1 clients ".$readingFnAttributes;
+
+  return undef;
+}
+
+sub
+CULGateway_Define(@) {
+  my ($hash, $def) = @_;
+  my ($name, $t, @dev) = split(/\s+/, $def);
+
+  return "Usage: define <name> CULGateway <device>[\@<baud>] [<device>[\@<baud>]...]" unless (@dev);
+  return "at most 8 devices" if (@dev > 8);
+  my @io = map { "${name}_".basename((split(/\@/, $_))[0]) } @dev;
+  foreach my $n (@io) {
+    return "$n already defined"
+      if (defined($defs{$n}) && (!defined($defs{$n}{SNAME}) || ($defs{$n}{SNAME} ne $name)));
+  }
+
+  CULGateway_Stop($hash);
+  CULGateway_Receivers($hash, undef);
+  $hash->{DEVICES} = join(' ', @dev);
+  $hash->{NOTIFYDEV} = "global";
+  CULGateway_Receivers($hash, \@io);
+  CULGateway_Start($hash) if ($init_done);
+  return undef;
+}
+
+# One IO device per receiver, temporary (not saved) as the connections of
+# FHEMWEB, so the clients see its NAME and RSSI and Dispatch keeps its
+# bookkeeping (MSGCNT, LASTInputDev, RAWMSG, autocreate). undef removes them.
+sub
+CULGateway_Receivers(@) {
+  my ($hash, $io) = @_;
+  my $name = $hash->{NAME};
+  if (!defined($io)) {
+    foreach my $r (@{$hash->{helper}->{io} || []}) {
+      next unless (defined($r) && defined($defs{$r->{NAME}}) && ($defs{$r->{NAME}} == $r));
+      delete $defs{$r->{NAME}};
+      delete $attr{$r->{NAME}};
+    }
+    delete $hash->{helper}->{io};
+    return undef;
+  }
+  my @r;
+  foreach my $n (@{$io}) {
+    my %r = ( NR => $devcount++, NAME => $n, TYPE => 'CULGateway', SNAME => $name,
+              TEMPORARY => 1, NOTIFYDEV => $name, STATE => 'ok' );
+    $defs{$n} = \%r;
+    push @r, \%r;
+  }
+  $hash->{helper}->{io} = \@r;
+  CULGateway_Clients($hash);
+  return undef;
+}
+
+# Dispatch asks them in this order
+sub
+CULGateway_Clients(@) {
+  my ($hash) = @_;
+  my @c = split(/:/, AttrVal($hash->{NAME}, 'clients', 'RFLinkStats:ParsePool:TechemHKV:TechemWZ:ESA2000:IT'));
+  foreach my $r (@{$hash->{helper}->{io} || []}) {
+    next unless defined($r);
+    $r->{Clients} = ':'.join(':', grep { $_ ne '' } @c).':';
+    $r->{'.clientArray'} = undef;
+  }
+  return undef;
+}
+
+sub
+CULGateway_Undef(@) {
+  my ($hash) = @_;
+  # a receiver: its records are dropped until the next define
+  if (defined($hash->{SNAME})) {
+    my $gw = $defs{$hash->{SNAME}};
+    if (defined($gw) && defined($gw->{helper}->{io})) {
+      @{$gw->{helper}->{io}} = map { (defined($_) && ($_ == $hash)) ? undef : $_ } @{$gw->{helper}->{io}};
+    }
+    return undef;
+  }
+  CULGateway_Stop($hash);
+  CULGateway_Receivers($hash, undef);
+  return undef;
+}
+
+sub
+CULGateway_Set(@) {
+  my ($hash, $name, $cmd, @args) = @_;
+  return "no set for a receiver, use $hash->{SNAME}" if (defined($hash->{SNAME}));
+  return "unknown command ($cmd): choose one of restart:noArg stop:noArg" if ($cmd !~ /^(?:restart|stop)$/);
+  CULGateway_Stop($hash);
+  CULGateway_Start($hash) if ($cmd eq 'restart');
+  return undef;
+}
+
+sub
+CULGateway_Notify(@) {
+  my ($hash, $ntfyDev) = @_;
+  return unless (!defined($hash->{SNAME}) && ($ntfyDev->{TYPE} eq 'Global'));
+  foreach my $event (@{$ntfyDev->{CHANGED}}) {
+    my @e = split(' ', $event);
+    next unless defined($e[0]);
+    CULGateway_Start($hash) if (($e[0] eq 'INITIALIZED') || ($e[0] eq 'REREADCFG'));
+    if (($e[0] eq 'ATTR') && defined($e[1]) && ($e[1] eq $hash->{NAME}) && defined($e[2]) && ($e[2] eq 'disable')) {
+      CULGateway_Stop($hash);
+      CULGateway_Start($hash);
+    }
+    CULGateway_Clients($hash)
+      if (($e[0] eq 'ATTR') && defined($e[1]) && ($e[1] eq $hash->{NAME}) && defined($e[2]) && ($e[2] eq 'clients'));
+  }
+  return undef;
+}
+
+# eventfd(0, EFD_NONBLOCK), not close on exec: the gateway inherits it
+sub
+CULGateway_Eventfd() {
+  my $nr = eval { require 'syscall.ph'; &SYS_eventfd2 };
+  $nr = ($Config{archname} =~ /aarch64/) ? 19 : ($Config{archname} =~ /^arm/) ? 356 :
+        ($Config{archname} =~ /^i\d86/) ? 328 : 290 unless (defined($nr));
+  my $fd = syscall($nr, 0, O_NONBLOCK);
+  return ($fd >= 0) ? $fd : undef;
+}
+
+sub
+CULGateway_Start(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  return undef if (defined($hash->{SNAME}) || defined($hash->{PID}) || AttrVal($name, 'disable', 0));
+
+  my $gw  = AttrVal($name, 'gateway', AttrVal('global', 'modpath', '.').'/contrib/cul_gateway');
+  my $shm = AttrVal($name, 'shm', "/dev/shm/fhem_$name");
+  my @cmd = ($gw, '-s', $shm);
+  push @cmd, '-r' if (AttrVal($name, 'rssi', 1));
+  push @cmd, map { ('-i', $_) } split(/,/, AttrVal($name, 'initCommands', 'X21'));
+
+  my $fd = CULGateway_Eventfd();
+  if (!defined($fd)) {
+    Log3 $name, 1, "$name: eventfd: $!";
+    return undef;
+  }
+  my $efh;
+  if (!open($efh, '<&=', $fd)) {
+    Log3 $name, 1, "$name: eventfd open: $!";
+    POSIX::close($fd);
+    return undef;
+  }
+  push @cmd, '-e', $fd, split(' ', $hash->{DEVICES});
+
+  my $pid = fhemFork();
+  if (!defined($pid)) {
+    Log3 $name, 1, "$name: fork: $!";
+    close($efh);
+    return undef;
+  }
+  if ($pid == 0) {
+    fcntl($efh, F_SETFD, 0);
+    exec(@cmd) or POSIX::_exit(1);
+  }
+
+  Log3 $name, 3, "$name: started ".join(' ', @cmd)." (pid $pid)";
+  $hash->{PID} = $pid;
+  $hash->{FD} = $fd;
+  $hash->{SHM} = $shm;
+  $hash->{helper}->{efh} = $efh;
+  $selectlist{$name} = $hash;
+  InternalTimer(gettimeofday() + CULGW_CHECK, "CULGateway_Check", $hash, 0);
+  readingsSingleUpdate($hash, 'state', 'starting', 1);
+  return undef;
+}
+
+# The eventfd stays open in fhem, so an exit of the gateway is not seen by
+# the ReadFn: poll for it and start it again
+sub
+CULGateway_Check(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  my $pid = $hash->{PID};
+  return undef unless (defined($pid));
+
+  # with SIGCHLD ignored there is no status to collect, -1 (ECHILD)
+  my $r = waitpid($pid, WNOHANG);
+  if (($r == $pid) || (($r == -1) && !kill(0, $pid))) {
+    Log3 $name, 1, "$name: gateway (pid $pid) exited".(($r == $pid) ? " with status ".($? >> 8) : '').", restarting";
+    delete $hash->{PID};
+    CULGateway_Stop($hash);
+    readingsSingleUpdate($hash, 'state', 'died', 1);
+    CULGateway_Start($hash);
+    return undef;
+  }
+  InternalTimer(gettimeofday() + CULGW_CHECK, "CULGateway_Check", $hash, 0);
+  return undef;
+}
+
+sub
+CULGateway_Stop(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  RemoveInternalTimer($hash);
+  delete $selectlist{$name};
+  if (defined($hash->{helper}->{efh})) {
+    close($hash->{helper}->{efh});
+    delete $hash->{helper}->{efh};
+  }
+  if (defined($hash->{helper}->{ring})) {
+    close($hash->{helper}->{ring});
+    delete $hash->{helper}->{ring};
+  }
+  if (defined($hash->{PID})) {
+    kill('TERM', $hash->{PID});
+    # with SIGCHLD ignored the kernel reaps, and waitpid would wait for all
+    # children to terminate
+    waitpid($hash->{PID}, 0) unless (defined($SIG{CHLD}) && ($SIG{CHLD} eq 'IGNORE'));
+    readingsSingleUpdate($hash, 'state', 'stopped', 1);
+  }
+  unlink($hash->{SHM}) if (defined($hash->{SHM}));
+  delete $hash->{PID};
+  delete $hash->{FD};
+  return undef;
+}
+
+# read at an offset of the ring file, the page cache is shared with the
+# mapping of the gateway
+sub
+CULGateway_Pread(@) {
+  my ($fh, $off, $len) = @_;
+  my $buf = '';
+  sysseek($fh, $off, 0) or return undef;
+  while (length($buf) < $len) {
+    my $n = sysread($fh, $buf, $len - length($buf), length($buf));
+    return undef unless ($n);
+  }
+  return $buf;
+}
+
+sub
+CULGateway_Open(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  my $fh;
+  if (!sysopen($fh, $hash->{SHM}, O_RDWR)) {
+    Log3 $name, 1, "$name: $hash->{SHM}: $!";
+    return undef;
+  }
+  my $h = CULGateway_Pread($fh, 0, 16);
+  my ($magic, $version, $recsize, $nrec) = unpack('V v v V', $h || '');
+  if (!defined($nrec) || ($magic != CULGW_MAGIC) || ($version != CULGW_VERSION)) {
+    Log3 $name, 1, "$name: $hash->{SHM}: not a gateway ring";
+    close($fh);
+    return undef;
+  }
+  $hash->{helper}->{ring} = $fh;
+  $hash->{helper}->{recsize} = $recsize;
+  $hash->{helper}->{nrec} = $nrec;
+  $hash->{helper}->{tail} = unpack('V', CULGateway_Pread($fh, CULGW_TAIL, 4));
+  readingsSingleUpdate($hash, 'state', 'opened', 1);
+  return $fh;
+}
+
+# eventfd readable: new records in the ring
+sub
+CULGateway_Read(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  my $buf;
+
+  sysread($hash->{helper}->{efh}, $buf, 8);
+  my $fh = $hash->{helper}->{ring} || CULGateway_Open($hash);
+  if (!defined($fh)) {
+    CULGateway_Stop($hash);
+    return undef;
+  }
+
+  my ($recsize, $nrec) = ($hash->{helper}->{recsize}, $hash->{helper}->{nrec});
+  my $tail = $hash->{helper}->{tail};
+  while (1) {
+    my ($head, $dropped, $badlines) = unpack('V V V', CULGateway_Pread($fh, CULGW_HEAD, 12));
+    $hash->{DROPPED} = $dropped;
+    $hash->{BADLINES} = $badlines;
+    my $cnt = ($head - $tail) & 0xFFFFFFFF;
+    last unless ($cnt);
+
+    # one read up to the end of the ring
+    my $slot = $tail & ($nrec - 1);
+    $cnt = $nrec - $slot if ($slot + $cnt > $nrec);
+    my $data = CULGateway_Pread($fh, CULGW_HDRSIZE + $slot * $recsize, $cnt * $recsize);
+    last unless (defined($data));
+    for (my $i = 0; $i < $cnt; $i++) {
+      CULGateway_Record($hash, unpack('V V C C C C v/a', substr($data, $i * $recsize, $recsize)));
+    }
+
+    $tail = ($tail + $cnt) & 0xFFFFFFFF;
+    $hash->{helper}->{tail} = $tail;
+    sysseek($fh, CULGW_TAIL, 0);
+    syswrite($fh, pack('V', $tail));
+  }
+  return undef;
+}
+
+# one record to Dispatch, with the receiver as IO, as CUL_Parse. The
+# clients only parse hex messages, so the payload is converted back.
+sub
+CULGateway_Record(@) {
+  my ($hash, $sec, $usec, $type, $rssi, $rcv, $flags, $data) = @_;
+  my $name = $hash->{NAME};
+  my $io = $hash->{helper}->{io}->[$rcv];
+  return undef unless (defined($io));
+  my $ioname = $io->{NAME};
+
+  my $msg = chr($type);
+  if ($flags & CULGW_F_RAW) {
+    Log3 $ioname, 4, "$ioname: $msg$data";
+    return undef;
+  }
+  my $hex = uc(unpack('H*', $data));
+  chop($hex) if ($flags & CULGW_F_NIBBLE);
+  $msg .= $hex;
+  my %addvals = (RAWMSG => $msg);
+  if ($flags & CULGW_F_RSSI) {
+    # as CUL.pm
+    $io->{RSSI} = ($rssi >= 128) ? (($rssi - 256) / 2 - 74) : ($rssi / 2 - 74);
+    $addvals{RSSI} = $io->{RSSI};
+    $msg .= "::$io->{RSSI}" if ($msg =~ m/^b/);
+  }
+  # time of reception, not of this read
+  $io->{"${ioname}_MSGCNT"}++;
+  $io->{"${ioname}_TIME"} = FmtDateTime($sec);
+  $io->{RAWMSG} = $addvals{RAWMSG};
+  $hash->{MSGCNT}++;
+
+  Dispatch($io, $msg, \%addvals);
+  return undef;
+}
+
+1;
+
+=pod
+=item summary    receive culfw messages through a native gateway and shared memory
+=item summary_DE Empfang von culfw-Nachrichten &uuml;ber ein natives Gateway und Shared Memory
+=begin html
+
+<a name="CULGateway"></a>
+<h3>CULGateway</h3>
+<ul>
+  This module starts contrib/cul_gateway, which reads one or more CUL devices and writes the
+  received messages as binary records (type, payload, RSSI, receiver, time of reception) into
+  a shared memory ring. fhem is woken up by an eventfd and dispatches the records to the client
+  modules, without a serial line and CUL.pm. The payload is dispatched as the hex message of
+  CUL.pm, so the client modules parse it as before; the binary form saves the line handling,
+  not the hex parsing of the clients.
+  <br><br>
+  Only messages that CUL.pm passes on unchanged are supported: Techem WMBus, ESA2000 and IT.
+  The client modules have to be loaded, e.g. by defining a device. Build the gateway with
+  <code>gcc -O2 -o cul_gateway cul_gateway.c</code> in contrib. Linux only.
+  <br><br>
+  <a name="CULGateway_Define"></a>
+  <b>Define</b>
+    <br>
+    <code>define &lt;name&gt; CULGateway &lt;device&gt;[@&lt;baud&gt;] [&lt;device&gt;[@&lt;baud&gt;]...]</code>
+    <br>
+    Up to 8 devices, the baudrate defaults to 38400. The client modules see each device as IO
+    &lt;name&gt;_&lt;device basename&gt;, a temporary device (not saved) created by the define.
+  <br><br>
+  <a name="CULGateway_Set"></a>
+  <b>Set</b>
+  <ul>
+    <li>restart: stop and start the gateway. If it exits on its own, it is started again
+      within 10 seconds.</li>
+    <li>stop: stop the gateway</li>
+  </ul>
+  <br>
+  <a name="CULGateway_Attr"></a>
+  <b>Attributes</b>
+  <ul>
+    <li>gateway: path of cul_gateway, default &lt;modpath&gt;/contrib/cul_gateway</li>
+    <li>shm: file of the ring, default /dev/shm/fhem_&lt;name&gt;</li>
+    <li>initCommands: comma separated commands sent to each device, default X21. Use e.g. X21,brt
+      for WMBus T mode.</li>
+    <li>rssi: 1 (default) if the devices append the RSSI (X21)</li>
+    <li>clients: colon separated client modules in the order they are asked, default
+      RFLinkStats:ParsePool:TechemHKV:TechemWZ:ESA2000:IT. Takes effect immediately.</li>
+    <li>disable: 1 stops the gateway</li>
+    <li><a href="#readingFnAttributes">readingFnAttributes</a></li>
+  </ul>
+  Changes of the other attributes take effect with <code>set restart</code>.
+</ul>
+=end html
+=cut
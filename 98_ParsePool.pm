@@ -0,0 +1,488 @@
+###############################################################################
+# $Id: 98_ParsePool.pm $
+#
+# this module is part of fhem under the same license
+#
+# decode received messages in forked worker processes
+#
+# history
+# initial checkin
+#
+###############################################################################
+package main;
+
+use strict;
+use warnings;
+
+use POSIX;
+use Socket;
+use IO::Handle;
+use Storable qw(nfreeze thaw);
+
+# modules with a <module>_Decode (pure, no device state) and a
+# <module>_Dispatch (readings), and how to get their meter ID. Only where
+# the decode costs more than the round trip to a worker, contrib/parse_bench.pl
+# -p: the Techem CRC yes, ESA2000_Decode (a few substr) no.
+my %ParsePool_key = (
+  TechemHKV => sub { substr($_[0], 9, 8) },
+  TechemWZ  => sub { substr($_[0], 9, 8) },
+);
+
+# points per worker on the hash ring
+use constant PARSEPOOL_VNODES => 64;
+# bytes queued for a worker before it counts as stalled
+use constant PARSEPOOL_MAXQUEUE => 262144;
+
+sub
+ParsePool_Initialize(@) {
+  my ($hash) = @_;
+
+  # Techem WMBus, see %ParsePool_key
+  $hash->{Match}      = "^b..446850";
+
+  $hash->{DefFn}      = "ParsePool_Define";
+  $hash->{UndefFn}    = "ParsePool_Undef";
+  $hash->{SetFn}      = "ParsePool_Set";
+  $hash->{NotifyFn}   = "ParsePool_Notify";
+  $hash->{ParseFn}    = "ParsePool_Parse";
+  $hash->{ReadFn}     = "ParsePool_Read";
+  # after the Techem IO patching, before RFLinkStats moves itself to front
+  $hash->{NotifyOrderPrefix} = "54-";
+
+  $hash->{AttrList}   = "disable:0,1 ".$readingFnAttributes;
+
+  return undef;
+}
+
+sub
+ParsePool_Define(@) {
+  my ($hash, $def) = @_;
+  my ($name, $t, $n) = split(/ /, $def, 3);
+
+  return "only one ParsePool device allowed"
+    if (defined($modules{ParsePool}{defptr}) && ($modules{ParsePool}{defptr} != $hash));
+  $n = 2 unless (defined($n));
+  return "number of workers must be 1..16" if ($n !~ /^\d+$/ || $n < 1 || $n > 16);
+
+  $modules{ParsePool}{defptr} = $hash;
+  $hash->{WORKERS} = $n;
+  ParsePool_Run($hash) if $init_done;
+  return undef;
+}
+
+sub
+ParsePool_Undef(@) {
+  my ($hash) = @_;
+  ParsePool_Stop($hash);
+  foreach my $d (keys %defs) {
+    next unless (($defs{$d}{TYPE} =~ /CUL|STACKABLE/) && defined($defs{$d}{Clients}));
+    $defs{$d}{Clients} =~ s/:ParsePool//;
+    $defs{$d}{'.clientArray'} = undef;
+  }
+  delete $modules{ParsePool}{defptr};
+  return undef;
+}
+
+sub
+ParsePool_Set(@) {
+  my ($hash, $name, $cmd, @args) = @_;
+  return "unknown command ($cmd): choose one of restart:noArg stop:noArg" if ($cmd !~ /^(?:restart|stop)$/);
+  ParsePool_Stop($hash);
+  ParsePool_Start($hash) if ($cmd eq 'restart');
+  return undef;
+}
+
+sub
+ParsePool_Notify(@) {
+  my ($hash, $ntfyDev) = @_;
+  return unless (($ntfyDev->{TYPE} =~ /CUL|STACKABLE/) || ($ntfyDev->{TYPE} eq 'Global'));
+  foreach my $event (@{$ntfyDev->{CHANGED}}) {
+    my @e = split(' ', $event);
+    next unless defined($e[0]);
+    ParsePool_Run($hash) if ($e[0] eq 'INITIALIZED');
+    ParsePool_IOPatch($hash, $e[1]) if (($e[0] eq 'DEFINED') && defined($e[1]) && defined($defs{$e[1]}));
+    ParsePool_IOPatch($hash, $e[1]) if (($e[0] eq 'ATTR') && defined($e[2]) && ($e[2] eq 'rfmode'));
+    if (($e[0] eq 'ATTR') && defined($e[1]) && ($e[1] eq $hash->{NAME}) && defined($e[2]) && ($e[2] eq 'disable')) {
+      ParsePool_Stop($hash);
+      ParsePool_Start($hash) unless (AttrVal($hash->{NAME}, 'disable', 0));
+    }
+  }
+  return undef;
+}
+
+sub
+ParsePool_Run(@) {
+  my ($hash) = @_;
+  ParsePool_Start($hash) unless (defined($hash->{helper}->{workers}) || AttrVal($hash->{NAME}, 'disable', 0));
+  foreach my $d (keys %defs) {
+    ParsePool_IOPatch($hash, $d);
+  }
+  return undef;
+}
+
+# live patch CUL.pm, same as TechemHKV_IOPatch. ParsePool_Parse claims the
+# messages, so it has to come before the decoding modules, but after
+# RFLinkStats which observes all of them.
+sub
+ParsePool_IOPatch(@) {
+  my ($hash, $iodev) = @_;
+  return undef unless (defined($defs{$iodev}) && ($defs{$iodev}{TYPE} =~ /CUL|STACKABLE/));
+  my $clients = $defs{$iodev}{Clients} || '';
+  return undef if ($clients =~ /^(?::RFLinkStats)?:ParsePool(?::|$)/);
+  $clients =~ s/:ParsePool//;
+  $clients = ":ParsePool".$clients unless ($clients =~ s/^:RFLinkStats/:RFLinkStats:ParsePool/);
+  $defs{$iodev}{Clients} = $clients;
+  $defs{$iodev}{'.clientArray'} = undef;
+  return undef;
+}
+
+###############################################################################
+# workers
+
+# 32 bit FNV-1a, with the murmur3 finalizer to spread the upper bits for
+# short keys like the meter IDs
+sub
+ParsePool_Hash(@) {
+  my $h = 0x811c9dc5;
+  foreach my $c (unpack('C*', $_[0])) {
+    $h = (($h ^ $c) * 0x01000193) & 0xFFFFFFFF;
+  }
+  $h ^= $h >> 16;
+  $h = ($h * 0x85ebca6b) & 0xFFFFFFFF;
+  $h ^= $h >> 13;
+  $h = ($h * 0xc2b2ae35) & 0xFFFFFFFF;
+  $h ^= $h >> 16;
+  return $h;
+}
+
+# consistent hashing: a meter stays on its worker, so its messages are
+# decoded and dispatched in order
+sub
+ParsePool_Shard(@) {
+  my ($hash, $key) = @_;
+  my $ring = $hash->{helper}->{ring};
+  my $h = ParsePool_Hash($key);
+  my ($lo, $hi) = (0, scalar(@{$ring}));
+  while ($lo < $hi) {
+    my $mid = ($lo + $hi) >> 1;
+    if ($ring->[$mid]->[0] < $h) {
+      $lo = $mid + 1;
+    } else {
+      $hi = $mid;
+    }
+  }
+  $lo = 0 if ($lo == @{$ring});
+  return $hash->{helper}->{workers}->[$ring->[$lo]->[1]];
+}
+
+sub
+ParsePool_Start(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  my (@w, @ring);
+
+  # only modules loaded now exist in the workers
+  my @mods;
+  {
+    no strict 'refs';
+    @mods = grep { defined(&{"main::${_}_Decode"}) && defined(&{"main::${_}_Dispatch"}) } sort keys %ParsePool_key;
+  }
+  $hash->{helper}->{mods} = \@mods;
+  $hash->{MODULES} = join(',', @mods);
+
+  # created by the first Techem define, the workers need it
+  $data{WMBUS}{crc_table_13757} = TechemHKV_createCrcTable()
+    if (!exists($data{WMBUS}{crc_table_13757}) && defined(&TechemHKV_createCrcTable));
+
+  for (my $i = 0; $i < $hash->{WORKERS}; $i++) {
+    my ($parent, $child);
+    if (!socketpair($parent, $child, AF_UNIX, SOCK_STREAM, PF_UNSPEC)) {
+      Log3 $name, 1, "$name: socketpair: $!";
+      last;
+    }
+    my $pid = defined(&fhemFork) ? fhemFork() : fork();
+    if (!defined($pid)) {
+      Log3 $name, 1, "$name: fork: $!";
+      close($parent);
+      close($child);
+      last;
+    }
+    if ($pid == 0) {
+      close($parent);
+      ParsePool_Worker($child);
+      POSIX::_exit(0);
+    }
+    close($child);
+    # fhem never waits for a worker: requests are queued in out and
+    # written by ParsePool_Flush. The write side is a dup, so it can be in
+    # the selectlist for writing while the socket stays there for reading.
+    $parent->blocking(0);
+    open(my $wfh, '>&', $parent);
+    my $w = { NAME => $name, FD => fileno($parent), fh => $parent, wfh => $wfh, pid => $pid, nr => $i,
+              buf => '', out => '', pend => [], sent => 0, done => 0 };
+    $w->{directReadFn} = \&ParsePool_Read;
+    $selectlist{"$name.worker$i"} = $w;
+    push @w, $w;
+    for (my $v = 0; $v < PARSEPOOL_VNODES; $v++) {
+      push @ring, [ ParsePool_Hash("$i-$v"), $i ];
+    }
+  }
+  return undef unless (@w);
+
+  $hash->{helper}->{workers} = \@w;
+  $hash->{helper}->{ring} = [ sort { $a->[0] <=> $b->[0] } @ring ];
+  readingsSingleUpdate($hash, 'state', int(@w).' workers', 1);
+  return undef;
+}
+
+sub
+ParsePool_Stop(@) {
+  my ($hash) = @_;
+  my $w = $hash->{helper}->{workers};
+  return undef unless defined($w);
+  foreach my $e (@{$w}) {
+    ParsePool_Close($hash, $e);
+  }
+  delete $hash->{helper}->{workers};
+  delete $hash->{helper}->{ring};
+  readingsSingleUpdate($hash, 'state', 'stopped', 1);
+  return undef;
+}
+
+sub
+ParsePool_Close(@) {
+  my ($hash, $e) = @_;
+  return undef unless defined($e->{fh});
+  delete $selectlist{"$hash->{NAME}.worker$e->{nr}"};
+  delete $selectlist{"$hash->{NAME}.worker$e->{nr}.out"};
+  close($e->{fh});
+  close($e->{wfh});
+  delete $e->{fh};
+  delete $e->{wfh};
+  kill('TERM', $e->{pid});
+  ParsePool_Reap($e);
+
+  # queued and pending messages are decoded inline now, in order: this may
+  # be within the Dispatch of a newer message (stalled worker)
+  my $pend = $e->{pend};
+  $e->{out} = $e->{buf} = '';
+  $e->{pend} = [];
+  my $r = $hash->{helper}->{result};
+  foreach my $p (@{$pend}) {
+    my $io = $defs{$p->[1]};
+    next unless (defined($io));
+    # the IO as it was for this message
+    local @{$io}{keys %{$p->[3]}} = values %{$p->[3]};
+    $hash->{helper}->{result} = [$p->[0], $p->[2], undef];
+    Dispatch($io, $p->[2], $p->[3]);
+  }
+  if (defined($r)) {
+    $hash->{helper}->{result} = $r;
+  } else {
+    delete $hash->{helper}->{result};
+  }
+  return undef;
+}
+
+# The worker exits on TERM or when it sees its socket closed. fhem does not
+# wait for it: until it is gone it is polled from a timer, KILL after 10s.
+sub
+ParsePool_Reap(@) {
+  my ($e) = @_;
+  # with SIGCHLD ignored the kernel reaps
+  return undef if (defined($SIG{CHLD}) && ($SIG{CHLD} eq 'IGNORE'));
+  return undef if (waitpid($e->{pid}, WNOHANG) != 0);
+  kill('KILL', $e->{pid}) if (++$e->{reap} == 10);
+  InternalTimer(gettimeofday() + 1, "ParsePool_Reap", $e, 0);
+  return undef;
+}
+
+# child: decode length framed "module\0msg" requests, reply with a frozen
+# [message] for each, in order, message is undef if the decode failed
+sub
+ParsePool_Worker(@) {
+  my ($fh) = @_;
+  my $buf = '';
+  no strict 'refs';
+  while (1) {
+    my $n = sysread($fh, $buf, 65536, length($buf));
+    return unless ($n);
+    while (length($buf) >= 4) {
+      my $l = unpack('N', $buf);
+      last if (length($buf) < 4 + $l);
+      my ($module, $msg) = split(/\0/, substr($buf, 4, $l), 2);
+      substr($buf, 0, 4 + $l) = '';
+      my $message = eval { &{"${module}_Decode"}($msg) };
+      return unless (ParsePool_Write($fh, nfreeze([$message])));
+    }
+  }
+}
+
+# worker side, the socket is blocking
+sub
+ParsePool_Write(@) {
+  my ($fh, $data) = @_;
+  $data = pack('N/a*', $data);
+  while (length($data)) {
+    my $n = syswrite($fh, $data);
+    return 0 unless (defined($n));
+    substr($data, 0, $n) = '';
+  }
+  return 1;
+}
+
+###############################################################################
+
+# claim a message for a worker, return an empty list to let Dispatch
+# continue (no pool, not our message or worker gone: decoded inline)
+sub
+ParsePool_Parse(@) {
+  my ($iohash, $msg) = @_;
+  my $hash = $modules{ParsePool}{defptr};
+  return () unless (defined($hash));
+
+  # second round, from ParsePool_Read: decoded by the worker, the module
+  # updates the readings and Dispatch does the rest as for any message
+  my $r = $hash->{helper}->{result};
+  if (defined($r) && ($r->[1] eq $msg)) {
+    delete $hash->{helper}->{result};
+    # from ParsePool_Close: not decoded, inline
+    return () unless (defined($r->[2]));
+    no strict 'refs';
+    return &{"$r->[0]_Dispatch"}($iohash, $r->[2]);
+  }
+  return () unless (defined($hash->{helper}->{workers}));
+
+  foreach my $m (@{$hash->{helper}->{mods}}) {
+    next unless ($msg =~ m/$modules{$m}{Match}/);
+    my $w = ParsePool_Shard($hash, $ParsePool_key{$m}->($msg));
+    return () unless (defined($w->{fh}));
+    if (length($w->{out}) > PARSEPOOL_MAXQUEUE) {
+      Log3 $hash->{NAME}, 2, "$hash->{NAME}: worker $w->{nr} stalled, decoding inline";
+      ParsePool_Close($hash, $w);
+      return ();
+    }
+    # the additional values the IO passed to Dispatch, for the second round
+    my %addvals;
+    foreach my $av (qw(RAWMSG RSSI)) {
+      $addvals{$av} = $iohash->{$av} if (defined($iohash->{$av}));
+    }
+    push @{$w->{pend}}, [$m, $iohash->{NAME}, $msg, \%addvals];
+    $w->{out} .= pack('N/a*', "$m\0$msg");
+    $w->{sent}++;
+    return () unless (ParsePool_Flush($w));
+    return ('');
+  }
+  return ();
+}
+
+# fhem side: write what the socket takes now, the rest when the select loop
+# finds it writable again
+sub
+ParsePool_Flush(@) {
+  my ($w) = @_;
+  my $hash = $defs{$w->{NAME}};
+  return 0 unless (defined($hash) && defined($w->{wfh}));
+  my $key = "$w->{NAME}.worker$w->{nr}.out";
+
+  my $n = syswrite($w->{wfh}, $w->{out});
+  if (!defined($n)) {
+    if (!($!{EAGAIN} || $!{EWOULDBLOCK} || $!{EINTR})) {
+      Log3 $hash->{NAME}, 2, "$hash->{NAME}: worker $w->{nr} write error: $!";
+      ParsePool_Close($hash, $w);
+      return 0;
+    }
+    $n = 0;
+  }
+  substr($w->{out}, 0, $n) = '';
+  if (!length($w->{out})) {
+    delete $selectlist{$key};
+  } elsif (!defined($selectlist{$key})) {
+    $selectlist{$key} = { NAME => $w->{NAME}, FD => fileno($w->{wfh}),
+                          directWriteFn => sub { ParsePool_Flush($w) } };
+  }
+  return 1;
+}
+
+# results of a worker: dispatch the message again, ParsePool_Parse hands
+# the decoded one to the module then
+sub
+ParsePool_Read(@) {
+  my ($w) = @_;
+  my $hash = $defs{$w->{NAME}};
+  return undef unless (defined($hash) && defined($w->{fh}));
+
+  my $n = sysread($w->{fh}, $w->{buf}, 65536, length($w->{buf}));
+  return undef if (!defined($n) && ($!{EAGAIN} || $!{EWOULDBLOCK} || $!{EINTR}));
+  if (!$n) {
+    Log3 $hash->{NAME}, 2, "$hash->{NAME}: worker $w->{nr} terminated, decoding inline";
+    ParsePool_Close($hash, $w);
+    return undef;
+  }
+
+  while (length($w->{buf}) >= 4) {
+    my $l = unpack('N', $w->{buf});
+    last if (length($w->{buf}) < 4 + $l);
+    my $r = thaw(substr($w->{buf}, 4, $l));
+    substr($w->{buf}, 0, 4 + $l) = '';
+    my $p = shift @{$w->{pend}};
+    $w->{done}++;
+    # failed decode (the module returns '' then), or the IO is gone
+    next unless (defined($p) && defined($r->[0]) && defined($defs{$p->[1]}));
+    $hash->{helper}->{result} = [$p->[0], $p->[2], $r->[0]];
+    Dispatch($defs{$p->[1]}, $p->[2], $p->[3]);
+    delete $hash->{helper}->{result};
+  }
+  return undef;
+}
+
+1;
+
+=pod
+=item summary    decode Techem messages in worker processes
+=item summary_DE Dekodiert Techem-Nachrichten in Hintergrundprozessen
+=begin html
+
+<a name="ParsePool"></a>
+<h3>ParsePool</h3>
+<ul>
+  This module moves the decoding of TechemHKV and TechemWZ messages (CRC checks and
+  field extraction) from the fhem process into forked worker processes. Only the decoded
+  records come back, they are dispatched again and the readings are updated by the modules
+  in fhem, so MSGCNT, LASTInputDev and autocreate work as without the pool. ESA2000 messages
+  are cheaper to decode than to hand over and stay in fhem.
+  <br><br>
+  fhem never waits for a worker: requests are queued and written when the worker takes them.
+  A worker with more than 256kB queued is stopped.
+  <br><br>
+  Messages are distributed by meter ID with consistent hashing, so all messages of a meter
+  are handled by the same worker and in order. If a worker terminates or is stopped, the
+  messages it has not answered yet are decoded inline, and so are its further messages until
+  the next <code>set restart</code>.
+  <br>
+  Workers are started after fhem is initialized and only know the modules loaded at that
+  time. Use <code>set restart</code> after defining the first device of another of these modules.
+  <br><br>
+  <a name="ParsePool_Define"></a>
+  <b>Define</b>
+    <br>
+    <code>define &lt;name&gt; ParsePool [&lt;workers&gt;]</code>
+    <br>
+    Only one device is allowed, the number of workers defaults to 2.
+  <br><br>
+  <a name="ParsePool_Set"></a>
+  <b>Set</b>
+  <ul>
+    <li>restart: stop and start the workers</li>
+    <li>stop: stop the workers, all messages are decoded inline</li>
+  </ul>
+  <br>
+  <a name="ParsePool_Attr"></a>
+  <b>Attributes</b>
+  <ul>
+    <li>disable: 1 stops the workers</li>
+    <li><a href="#readingFnAttributes">readingFnAttributes</a></li>
+  </ul>
+</ul>
+=end html
+=cut
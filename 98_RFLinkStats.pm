@@ -0,0 +1,401 @@
+###############################################################################
+# $Id: 98_RFLinkStats.pm $
+#
+# this module is part of fhem under the same license
+#
+# per device link quality statistics for messages received by CUL devices
+#
+# history
+# initial checkin
+#
+###############################################################################
+package main;
+
+use strict;
+use warnings;
+
+use Time::HiRes qw(time);
+
+# slots of a table entry, one array per device key
+use constant {
+  RFLS_TYPE   => 0,   # protocol
+  RFLS_FIRST  => 1,   # first seen
+  RFLS_LAST   => 2,   # last seen
+  RFLS_HOUR   => 3,   # hour of RFLS_NHOUR
+  RFLS_NHOUR  => 4,   # frames in current hour
+  RFLS_NPREV  => 5,   # frames in previous hour
+  RFLS_FRAMES => 6,   # frames total
+  RFLS_SEQ    => 7,   # last sequence number (ESA) or last message (FS20)
+  RFLS_EXPECT => 8,   # frames expected
+  RFLS_RECV   => 9,   # frames received
+  RFLS_HIST   => 10,  # rssi histogram
+  RFLS_RX     => 11,  # per receiver: [rssi average, frames]
+};
+
+# rssi histogram: 32 bins of 4dB starting at -130dBm
+use constant {
+  RFLS_HBASE  => -130,
+  RFLS_HSTEP  => 4,
+  RFLS_HBINS  => 32,
+};
+
+sub
+RFLinkStats_Initialize(@) {
+  my ($hash) = @_;
+
+  # FS20 and FHT as reformatted by CUL.pm, ESA2000, IT and Techem WMBus
+  $hash->{Match}      = "^(?:81..(?:04|0c)..(?:0101|0909)a001|S|i|b..446850)";
+
+  $hash->{DefFn}      = "RFLinkStats_Define";
+  $hash->{UndefFn}    = "RFLinkStats_Undef";
+  $hash->{SetFn}      = "RFLinkStats_Set";
+  $hash->{GetFn}      = "RFLinkStats_Get";
+  $hash->{NotifyFn}   = "RFLinkStats_Notify";
+  $hash->{ParseFn}    = "RFLinkStats_Parse";
+  # run after the other IO patching modules, see RFLinkStats_IOPatch
+  $hash->{NotifyOrderPrefix} = "55-";
+
+  $hash->{AttrList}   = "interval weakRssi weakLoss maxAge dropAge fs20Repeats ".$readingFnAttributes;
+
+  return undef;
+}
+
+sub
+RFLinkStats_Define(@) {
+  my ($hash, $def) = @_;
+  my ($name, $t) = split(/ /, $def, 3);
+
+  return "only one RFLinkStats device allowed"
+    if (defined($modules{RFLinkStats}{defptr}) && ($modules{RFLinkStats}{defptr} != $hash));
+
+  $modules{RFLinkStats}{defptr} = $hash;
+  $hash->{helper}->{table} = {} unless defined($hash->{helper}->{table});
+  # DEFINED, ATTR and INITIALIZED are global events
+  $hash->{NOTIFYDEV} = "global";
+
+  RemoveInternalTimer($hash);
+  InternalTimer(time() + AttrVal($name, 'interval', 300), "RFLinkStats_Snapshot", $hash, 0);
+  RFLinkStats_Run($hash) if $init_done;
+  return undef;
+}
+
+sub
+RFLinkStats_Undef(@) {
+  my ($hash) = @_;
+  RemoveInternalTimer($hash);
+  foreach my $d (keys %defs) {
+    next unless (($defs{$d}{TYPE} =~ /CUL|STACKABLE/) && defined($defs{$d}{Clients}));
+    $defs{$d}{Clients} =~ s/:RFLinkStats//;
+    $defs{$d}{'.clientArray'} = undef;
+  }
+  delete $modules{RFLinkStats}{defptr};
+  return undef;
+}
+
+sub
+RFLinkStats_Set(@) {
+  my ($hash, $name, $cmd, @args) = @_;
+  return "unknown command ($cmd): choose one of reset:noArg snapshot:noArg" if ($cmd !~ /^(?:reset|snapshot)$/);
+  $hash->{helper}->{table} = {} if ($cmd eq 'reset');
+  RFLinkStats_Snapshot($hash);
+  return undef;
+}
+
+sub
+RFLinkStats_Get(@) {
+  my ($hash, $name, $cmd, @args) = @_;
+  return "unknown command ($cmd): choose one of stats weak:noArg" if ($cmd !~ /^(?:stats|weak)$/);
+
+  my $s = $hash->{helper}->{snapshot};
+  return "no snapshot yet" unless defined($s);
+  my $filter = $args[0];
+  my $result = sprintf("%-18s %6s %6s %6s %5s %5s %5s %5s  %s\n",
+                       'device', 'frames', 'rate/h', 'age', 'loss%', 'p10', 'p50', 'p90', 'best receiver');
+  foreach my $key (sort keys %{$s}) {
+    my $e = $s->{$key};
+    next if (($cmd eq 'weak') && !$e->{weak});
+    next if (defined($filter) && ($key !~ /$filter/));
+    $result .= sprintf("%-18s %6d %6d %6d %5s %5s %5s %5s  %s\n",
+                       $key, $e->{frames}, $e->{rate}, $e->{age},
+                       $e->{loss}, $e->{p10}, $e->{p50}, $e->{p90}, $e->{best});
+  }
+  return $result;
+}
+
+sub
+RFLinkStats_Notify(@) {
+  my ($hash, $ntfyDev) = @_;
+  return unless ($ntfyDev->{TYPE} eq 'Global');
+  foreach my $event (@{$ntfyDev->{CHANGED}}) {
+    my @e = split(' ', $event);
+    next unless defined($e[0]);
+    RFLinkStats_Run($hash) if ($e[0] eq 'INITIALIZED');
+    RFLinkStats_IOPatch($hash, $e[1]) if (($e[0] eq 'DEFINED') && defined($e[1]) && defined($defs{$e[1]}));
+    # other modules prepend themselves on rfmode changes, move to front again
+    RFLinkStats_IOPatch($hash, $e[1]) if (($e[0] eq 'ATTR') && defined($e[2]) && ($e[2] eq 'rfmode'));
+  }
+  return undef;
+}
+
+sub
+RFLinkStats_Run(@) {
+  my ($hash) = @_;
+  foreach my $d (keys %defs) {
+    RFLinkStats_IOPatch($hash, $d);
+  }
+  return undef;
+}
+
+# live patch CUL.pm, same as TechemHKV_IOPatch. RFLinkStats_Parse does not
+# claim messages, so it has to be the first client to see all of them.
+sub
+RFLinkStats_IOPatch(@) {
+  my ($hash, $iodev) = @_;
+  return undef unless (defined($defs{$iodev}) && ($defs{$iodev}{TYPE} =~ /CUL|STACKABLE/));
+  my $clients = $defs{$iodev}{Clients} || '';
+  return undef if ($clients =~ /^:RFLinkStats(?::|$)/);
+  $clients =~ s/:RFLinkStats//;
+  $defs{$iodev}{Clients} = ":RFLinkStats".$clients;
+  $defs{$iodev}{'.clientArray'} = undef;
+  readingsSingleUpdate($hash, 'state', 'active', 1);
+  return undef;
+}
+
+# observe only, returning an empty list lets Dispatch continue with the
+# next client
+sub
+RFLinkStats_Parse(@) {
+  my ($iohash, $msg) = @_;
+  my $hash = $modules{RFLinkStats}{defptr};
+  return () unless defined($hash);
+  # dispatched again by 98_ParsePool after decoding, counted already
+  my $pp = $modules{ParsePool}{defptr};
+  return () if (defined($pp) && defined($pp->{helper}->{result}));
+
+  my $rssi;
+  ($msg, $rssi) = split(/::/, $msg);
+  $rssi = $iohash->{RSSI} unless defined($rssi);
+
+  my ($type, $key, $seq, $mod);
+  if ($msg =~ /^81..(?:04|0c)..0101a001(......)00(.*)/) {
+    ($type, $key, $seq) = ('FS20', "FS20_$1", $2);
+  } elsif ($msg =~ /^81..(?:04|0c)..0909a001(....)/) {
+    ($type, $key) = ('FHT', "FHT_$1");
+  } elsif ($msg =~ /^S(..)(....)(..)/) {
+    # GIRA uses a 6 bit sequence
+    $mod = (lc($3) eq 'cc')?64:128;
+    ($type, $key, $seq) = ('ESA', 'ESA_'.lc($2), hex($1) % $mod);
+  } elsif ($msg =~ /^b..446850(........)/) {
+    ($type, $key) = ('Techem', 'Techem_'.join('', reverse($1 =~ /(..)/g)));
+  } elsif ($msg =~ /^i((?:..)+)..$/) {
+    # last byte is the command
+    ($type, $key) = ('IT', "IT_$1");
+  } else {
+    return ();
+  }
+
+  RFLinkStats_Update($hash, $type, $key, $seq, $mod, $iohash->{NAME}, $rssi);
+  return ();
+}
+
+sub
+RFLinkStats_Update(@) {
+  my ($hash, $type, $key, $seq, $mod, $rx, $rssi) = @_;
+  my $now = time();
+  my $hour = int($now / 3600);
+
+  my $e = $hash->{helper}->{table}->{$key};
+  unless (defined($e)) {
+    $e = $hash->{helper}->{table}->{$key} = [ $type, $now, 0, $hour, 0, 0, 0, undef, 0, 0, [ (0) x RFLS_HBINS ], {} ];
+  }
+
+  # frames per hour
+  if ($e->[RFLS_HOUR] != $hour) {
+    $e->[RFLS_NPREV] = ($e->[RFLS_HOUR] + 1 == $hour)?$e->[RFLS_NHOUR]:0;
+    $e->[RFLS_NHOUR] = 0;
+    $e->[RFLS_HOUR] = $hour;
+  }
+  $e->[RFLS_NHOUR]++;
+  $e->[RFLS_FRAMES]++;
+
+  # expected vs. received
+  if ($type eq 'ESA') {
+    if (!defined($e->[RFLS_SEQ])) {
+      $e->[RFLS_EXPECT]++;
+      $e->[RFLS_RECV]++;
+    } elsif ($seq != $e->[RFLS_SEQ]) {
+      # repeated copies carry the same sequence, only count the gap
+      $e->[RFLS_EXPECT] += ($seq - $e->[RFLS_SEQ]) % $mod;
+      $e->[RFLS_RECV]++;
+    }
+    $e->[RFLS_SEQ] = $seq;
+  } elsif ($type eq 'FS20') {
+    # copies of the same command within 0.5s belong to one burst
+    my $rep = AttrVal($hash->{NAME}, 'fs20Repeats', 1);
+    if (!defined($e->[RFLS_SEQ]) || ($e->[RFLS_SEQ] ne $seq) || ($now - $e->[RFLS_LAST] > 0.5)) {
+      $e->[RFLS_EXPECT] += $rep;
+      $e->[RFLS_RECV]++;
+    } elsif ($e->[RFLS_RECV] < $e->[RFLS_EXPECT]) {
+      $e->[RFLS_RECV]++;
+    }
+    $e->[RFLS_SEQ] = $seq;
+  }
+  $e->[RFLS_LAST] = $now;
+
+  return undef unless (defined($rssi) && ($rssi =~ /^-?\d+(?:\.\d+)?$/));
+
+  # rssi distribution
+  my $bin = int(($rssi - RFLS_HBASE) / RFLS_HSTEP);
+  $bin = 0 if ($bin < 0);
+  $bin = RFLS_HBINS - 1 if ($bin >= RFLS_HBINS);
+  $e->[RFLS_HIST]->[$bin]++;
+
+  # receiver average, weight 1/8
+  if (defined($rx)) {
+    my $r = $e->[RFLS_RX]->{$rx};
+    if (defined($r)) {
+      $r->[0] += ($rssi - $r->[0]) / 8;
+      $r->[1]++;
+    } else {
+      $e->[RFLS_RX]->{$rx} = [ $rssi, 1 ];
+    }
+  }
+  return undef;
+}
+
+sub
+RFLinkStats_Percentile(@) {
+  my ($hist, $total, $p) = @_;
+  return '-' unless ($total);
+  my $n = 0;
+  for (my $i = 0; $i < RFLS_HBINS; $i++) {
+    $n += $hist->[$i];
+    return RFLS_HBASE + ($i * RFLS_HSTEP) + (RFLS_HSTEP / 2) if ($n * 100 >= $total * $p);
+  }
+  return '-';
+}
+
+sub
+RFLinkStats_Snapshot(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  my $now = time();
+  my $hour = int($now / 3600);
+  my $weakRssi = AttrVal($name, 'weakRssi', -95);
+  my $weakLoss = AttrVal($name, 'weakLoss', 20);
+  my $maxAge = AttrVal($name, 'maxAge', 3600);
+  my $dropAge = AttrVal($name, 'dropAge', 7 * 86400);
+  my (%s, @weak);
+
+  RemoveInternalTimer($hash);
+  InternalTimer($now + AttrVal($name, 'interval', 300), "RFLinkStats_Snapshot", $hash, 0);
+
+  my $t = $hash->{helper}->{table};
+  foreach my $key (keys %{$t}) {
+    my $e = $t->{$key};
+    # one-off decodes of noise would otherwise stay forever
+    if ($now - $e->[RFLS_LAST] > $dropAge) {
+      delete $t->{$key};
+      next;
+    }
+    my $hist = $e->[RFLS_HIST];
+    my $total = 0;
+    $total += $_ foreach (@{$hist});
+
+    my %r;
+    $r{type} = $e->[RFLS_TYPE];
+    $r{frames} = $e->[RFLS_FRAMES];
+    $r{age} = int($now - $e->[RFLS_LAST]);
+    # last full hour, or the current one if the device is new
+    if ($e->[RFLS_HOUR] == $hour) {
+      $r{rate} = ($e->[RFLS_FIRST] > ($hour - 1) * 3600)?$e->[RFLS_NHOUR]:$e->[RFLS_NPREV];
+    } else {
+      $r{rate} = ($e->[RFLS_HOUR] + 1 == $hour)?$e->[RFLS_NHOUR]:0;
+    }
+    $r{loss} = ($e->[RFLS_EXPECT])?sprintf("%.1f", 100 * ($e->[RFLS_EXPECT] - $e->[RFLS_RECV]) / $e->[RFLS_EXPECT]):'-';
+    $r{p10} = RFLinkStats_Percentile($hist, $total, 10);
+    $r{p50} = RFLinkStats_Percentile($hist, $total, 50);
+    $r{p90} = RFLinkStats_Percentile($hist, $total, 90);
+
+    my $rx = $e->[RFLS_RX];
+    my ($best) = sort { $rx->{$b}->[0] <=> $rx->{$a}->[0] } keys %{$rx};
+    $r{best} = (defined($best))?sprintf("%s (%.1f)", $best, $rx->{$best}->[0]):'-';
+
+    $r{weak} = (($r{age} > $maxAge) ||
+                (($r{p50} ne '-') && ($r{p50} < $weakRssi)) ||
+                (($r{loss} ne '-') && ($r{loss} > $weakLoss)))?1:0;
+    push @weak, $key if ($r{weak});
+    $s{$key} = \%r;
+  }
+  $hash->{helper}->{snapshot} = \%s;
+
+  readingsBeginUpdate($hash);
+  readingsBulkUpdate($hash, 'devices', scalar(keys %s));
+  readingsBulkUpdate($hash, 'weak', scalar(@weak));
+  readingsBulkUpdate($hash, 'weakList', (@weak)?join(',', sort @weak):'none');
+  readingsEndUpdate($hash, 1);
+  return undef;
+}
+
+1;
+
+=pod
+=item summary    link quality statistics for devices received by CUL
+=item summary_DE Empfangsstatistik der über CUL empfangenen Geräte
+=begin html
+
+<a name="RFLinkStats"></a>
+<h3>RFLinkStats</h3>
+<ul>
+  This module keeps link quality statistics for every device received by a CUL, including devices
+  that are not defined in fhem. It helps to find weak devices before they drop out.
+  <br><br>
+  Tracked are FS20 (housecode and button), FHT (housecode), ESA2000 (code), Techem (8 digit ID) and IT (code).
+  For each device it counts frames per hour, expected vs. received frames (ESA2000 sequence numbers,
+  FS20 repeats), the RSSI distribution and the receiver with the best average RSSI.
+  <br>
+  RSSI values are only available if the CUL reports them.
+  <br><br>
+  <a name="RFLinkStats_Define"></a>
+  <b>Define</b>
+    <br>
+    <code>define &lt;name&gt; RFLinkStats</code>
+    <br>
+    Only one device is allowed, it observes all CUL/STACKABLE IO devices.
+  <br><br>
+  <a name="RFLinkStats_Set"></a>
+  <b>Set</b>
+  <ul>
+    <li>reset: clear all statistics</li>
+    <li>snapshot: update the snapshot now</li>
+  </ul>
+  <br>
+  <a name="RFLinkStats_Get"></a>
+  <b>Get</b>
+  <ul>
+    <li>stats [&lt;regex&gt;]: table of the last snapshot, optionally filtered by device</li>
+    <li>weak: devices of the last snapshot considered weak</li>
+  </ul>
+  <br>
+  <a name="RFLinkStats_Attr"></a>
+  <b>Attributes</b>
+  <ul>
+    <li>interval: seconds between snapshots, default 300</li>
+    <li>weakRssi: median RSSI (dBm) below which a device is weak, default -95</li>
+    <li>weakLoss: loss in percent above which a device is weak, default 20</li>
+    <li>maxAge: seconds without a frame after which a device is weak, default 3600</li>
+    <li>dropAge: seconds without a frame after which a device is removed from the statistics, default 604800 (7 days)</li>
+    <li>fs20Repeats: copies expected per FS20 command, default 1. Set to 3 if the CUL reports repeated messages.</li>
+    <li><a href="#readingFnAttributes">readingFnAttributes</a></li>
+  </ul>
+  <br>
+  <a name="RFLinkStats_Readings"></a>
+  <b>Readings</b>
+  <ul>
+    <li>devices: number of devices seen</li>
+    <li>weak: number of weak devices</li>
+    <li>weakList: weak devices</li>
+  </ul>
+</ul>
+=end html
+=cut
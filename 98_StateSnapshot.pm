@@ -0,0 +1,316 @@
+###############################################################################
+# $Id: 98_StateSnapshot.pm $
+#
+# this module is part of fhem under the same license
+#
+# binary snapshot of the readings and helper state of meter devices
+#
+# history
+# initial checkin
+#
+###############################################################################
+package main;
+
+use strict;
+use warnings;
+
+use File::Basename;
+use Storable qw(nstore retrieve nfreeze thaw);
+use Time::HiRes qw(time);
+
+use constant STATESNAPSHOT_VERSION => 2;
+
+sub
+StateSnapshot_Initialize(@) {
+  my ($hash) = @_;
+
+  $hash->{DefFn}      = "StateSnapshot_Define";
+  $hash->{UndefFn}    = "StateSnapshot_Undef";
+  $hash->{SetFn}      = "StateSnapshot_Set";
+  $hash->{NotifyFn}   = "StateSnapshot_Notify";
+  $hash->{ShutdownFn} = "StateSnapshot_Shutdown";
+  # restore before the other modules see INITIALIZED
+  $hash->{NotifyOrderPrefix} = "10-";
+
+  $hash->{AttrList}   = "types file keepStatefile:0,1 disable:0,1 ".$readingFnAttributes;
+
+  return undef;
+}
+
+sub
+StateSnapshot_Define(@) {
+  my ($hash, $def) = @_;
+  my ($name, $t, $interval) = split(/\s+/, $def, 3);
+
+  $interval = 300 unless (defined($interval));
+  return "interval must be a number of seconds >= 60" if ($interval !~ /^\d+$/ || $interval < 60);
+  $hash->{INTERVAL} = $interval;
+  $hash->{NOTIFYDEV} = "global";
+
+  RemoveInternalTimer($hash);
+  InternalTimer(time() + $interval, "StateSnapshot_Timer", $hash, 0);
+  return undef;
+}
+
+sub
+StateSnapshot_Undef(@) {
+  my ($hash) = @_;
+  RemoveInternalTimer($hash);
+  return undef;
+}
+
+sub
+StateSnapshot_Set(@) {
+  my ($hash, $name, $cmd, @args) = @_;
+  return "unknown command ($cmd): choose one of save:noArg restore:noArg" if ($cmd !~ /^(?:save|restore)$/);
+  return StateSnapshot_Save($hash) if ($cmd eq 'save');
+  return StateSnapshot_Restore($hash);
+}
+
+sub
+StateSnapshot_Notify(@) {
+  my ($hash, $ntfyDev) = @_;
+  return unless ($ntfyDev->{TYPE} eq 'Global');
+  foreach my $event (@{$ntfyDev->{CHANGED}}) {
+    next unless defined($event);
+    StateSnapshot_Restore($hash) if ($event eq 'INITIALIZED');
+  }
+  return undef;
+}
+
+# called before fhem writes the statefile. With keepStatefile 0 the readings
+# of the saved devices are left out of it, fhem then does not read them as
+# setstate lines at startup and the restore sets them. Only devices which
+# are in the snapshot as it reads back from the file lose their readings.
+sub
+StateSnapshot_Shutdown(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  return undef if (AttrVal($name, 'disable', 0));
+  return undef if (defined(StateSnapshot_Save($hash)) || AttrVal($name, 'keepStatefile', 1));
+
+  my $file = StateSnapshot_File($hash);
+  my $s = eval { retrieve($file) };
+  if (!defined($s) || (ref($s) ne 'HASH') || (($s->{version} || 0) != STATESNAPSHOT_VERSION)) {
+    Log3 $name, 1, "$name: $file does not read back, the statefile keeps the readings";
+    return undef;
+  }
+  my $n = 0;
+  foreach my $d (keys %{$s->{devices}}) {
+    my $dh = $defs{$d};
+    next unless (defined($dh));
+    my $e = eval { thaw($s->{devices}->{$d}) };
+    next unless (defined($e) && (ref($e->{READINGS}) eq 'HASH') &&
+                 (scalar(keys %{$e->{READINGS}}) == scalar(keys %{$dh->{READINGS} || {}})));
+    delete $dh->{READINGS};
+    $n++;
+  }
+  Log3 $name, 3, "$name: readings of $n devices left out of the statefile";
+  return undef;
+}
+
+sub
+StateSnapshot_Timer(@) {
+  my ($hash) = @_;
+  StateSnapshot_Save($hash);
+  InternalTimer(time() + $hash->{INTERVAL}, "StateSnapshot_Timer", $hash, 0);
+  return undef;
+}
+
+# next to the statefile by default
+sub
+StateSnapshot_File(@) {
+  my ($hash) = @_;
+  my $dir = dirname(AttrVal('global', 'statefile', './log/fhem.save'));
+  return AttrVal($hash->{NAME}, 'file', "$dir/$hash->{NAME}.snapshot");
+}
+
+sub
+StateSnapshot_Types(@) {
+  my ($hash) = @_;
+  my %t = map { $_ => 1 } split(/,/, AttrVal($hash->{NAME}, 'types', 'TechemHKV,TechemWZ,ESA2000'));
+  return \%t;
+}
+
+# a device is frozen again if one of these changed, they change with each
+# received message and each reading set
+sub
+StateSnapshot_Sig(@) {
+  my ($dh) = @_;
+  my $rd = $dh->{READINGS} || {};
+  my $ts = '';
+  foreach my $r (values %{$rd}) {
+    $ts = $r->{TIME} if (defined($r->{TIME}) && ($r->{TIME} gt $ts));
+  }
+  return join(',', $dh->{MSGCNT} || 0, scalar(keys %{$rd}), $ts);
+}
+
+# the helper without code or IO handles, they belong to the Define
+sub
+StateSnapshot_Helper(@) {
+  my ($h) = @_;
+  my %h;
+  foreach my $k (keys %{$h}) {
+    my $r = ref($h->{$k});
+    $h{$k} = $h->{$k} if (($r eq '') || ($r eq 'HASH') || ($r eq 'ARRAY') || ($r eq 'SCALAR'));
+  }
+  return \%h;
+}
+
+# Each device is kept frozen between the saves and only frozen again when
+# it changed, the file is written from the frozen devices.
+sub
+StateSnapshot_Save(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  return undef if (AttrVal($name, 'disable', 0));
+
+  my $t0 = time();
+  my $types = StateSnapshot_Types($hash);
+  my $frozen = $hash->{helper}->{frozen} ||= {};
+  my %dev;
+  my $nf = 0;
+  foreach my $d (keys %defs) {
+    my $dh = $defs{$d};
+    next unless ($types->{$dh->{TYPE}});
+    my $sig = StateSnapshot_Sig($dh);
+    my $f = $frozen->{$d};
+    if (!defined($f) || ($f->[0] ne $sig)) {
+      my $e = { TYPE => $dh->{TYPE}, DEF => $dh->{DEF}, READINGS => $dh->{READINGS} };
+      $e->{helper} = StateSnapshot_Helper($dh->{helper}) if (defined($dh->{helper}));
+      my $blob = eval { nfreeze($e) };
+      if (!defined($blob)) {
+        Log3 $name, 2, "$name: $d not saved: $@";
+        delete $frozen->{$d};
+        next;
+      }
+      $f = $frozen->{$d} = [ $sig, $blob ];
+      $nf++;
+    }
+    $dev{$d} = $f->[1];
+  }
+  # deleted or excluded devices
+  foreach my $d (keys %{$frozen}) {
+    delete $frozen->{$d} unless (exists($dev{$d}));
+  }
+
+  my $file = StateSnapshot_File($hash);
+  my $ok = eval { nstore({ version => STATESNAPSHOT_VERSION, time => $t0, devices => \%dev }, "$file.tmp") };
+  if (!$ok || !rename("$file.tmp", $file)) {
+    my $err = $@ || $!;
+    unlink("$file.tmp");
+    Log3 $name, 1, "$name: cannot write $file: $err";
+    readingsSingleUpdate($hash, 'state', 'error', 1);
+    return "cannot write $file: $err";
+  }
+
+  readingsBeginUpdate($hash);
+  readingsBulkUpdate($hash, 'devices', scalar(keys %dev));
+  readingsBulkUpdate($hash, 'frozen', $nf);
+  readingsBulkUpdate($hash, 'saveTime', sprintf('%.3f', time() - $t0));
+  readingsBulkUpdate($hash, 'state', 'saved');
+  readingsEndUpdate($hash, 1);
+  return undef;
+}
+
+# Readings newer than those from the statefile and helper entries which are
+# not set yet by the Define are taken over, for devices with the same TYPE
+# and DEF. The helper is skipped if the statefile has newer readings.
+sub
+StateSnapshot_Restore(@) {
+  my ($hash) = @_;
+  my $name = $hash->{NAME};
+  my $file = StateSnapshot_File($hash);
+  return undef if (AttrVal($name, 'disable', 0) || !-e $file);
+
+  my $t0 = time();
+  my $s = eval { retrieve($file) };
+  if (!defined($s) || (ref($s) ne 'HASH') || (($s->{version} || 0) != STATESNAPSHOT_VERSION)) {
+    Log3 $name, 1, "$name: $file is no snapshot".($@ ? ": $@" : '');
+    return "$file is no snapshot";
+  }
+
+  my ($n, $nr) = (0, 0);
+  foreach my $d (keys %{$s->{devices}}) {
+    my $dh = $defs{$d};
+    next unless (defined($dh));
+    my $e = eval { thaw($s->{devices}->{$d}) };
+    next unless (defined($e) && ($dh->{TYPE} eq $e->{TYPE}) && (($dh->{DEF} || '') eq ($e->{DEF} || '')));
+    my $stale = 0;
+    foreach my $r (keys %{$e->{READINGS}}) {
+      my $cur = $dh->{READINGS}->{$r};
+      my $ts = $e->{READINGS}->{$r}->{TIME} || '';
+      if (defined($cur) && defined($cur->{TIME}) && ($cur->{TIME} ge $ts)) {
+        $stale = 1 if ($cur->{TIME} gt $ts);
+        next;
+      }
+      $dh->{READINGS}->{$r} = $e->{READINGS}->{$r};
+      $nr++;
+    }
+    # a helper cache older than the readings would be wrong
+    if (defined($e->{helper}) && !$stale) {
+      foreach my $k (keys %{$e->{helper}}) {
+        $dh->{helper}->{$k} = $e->{helper}->{$k} unless (exists($dh->{helper}->{$k}));
+      }
+    }
+    $n++;
+  }
+
+  Log3 $name, 3, sprintf("%s: restored %d devices, %d newer readings in %.3fs", $name, $n, $nr, time() - $t0);
+  readingsSingleUpdate($hash, 'state', "restored $n", 1);
+  return undef;
+}
+
+1;
+
+=pod
+=item summary    binary snapshot of the state of meter devices
+=item summary_DE Bin&auml;rer Schnappschuss des Zustands von Z&auml;hler-Devices
+=begin html
+
+<a name="StateSnapshot"></a>
+<h3>StateSnapshot</h3>
+<ul>
+  This module saves the readings and the helper state (e.g. the TechemWZ list mode and the
+  ESA2000 reading cache) of TechemHKV, TechemWZ and ESA2000 devices with Storable in a binary
+  file, periodically and at shutdown. After a restart the helper state is restored from it,
+  and readings which are newer than those of the statefile (e.g. after a crash) are taken over.
+  <br><br>
+  The restore runs on INITIALIZED, before the other modules are notified. By default the
+  statefile keeps all readings. With keepStatefile 0 the readings of these devices are left
+  out of the statefile written at shutdown, so fhem does not have to read them as text at
+  startup, and the restore sets them. This is only done for devices which are in the snapshot
+  as it reads back from the file after the final save. Until the next start these readings
+  are only in the snapshot: they are lost if the file is deleted or damaged, or if the
+  StateSnapshot device is deleted or disabled before the restore.
+  <br><br>
+  Only devices which changed since the last save (messages received, readings set) are
+  serialized again.
+  <br><br>
+  <a name="StateSnapshot_Define"></a>
+  <b>Define</b>
+    <br>
+    <code>define &lt;name&gt; StateSnapshot [&lt;interval&gt;]</code>
+    <br>
+    The interval defaults to 300 seconds.
+  <br><br>
+  <a name="StateSnapshot_Set"></a>
+  <b>Set</b>
+  <ul>
+    <li>save: write the snapshot now</li>
+    <li>restore: read the snapshot again</li>
+  </ul>
+  <br>
+  <a name="StateSnapshot_Attr"></a>
+  <b>Attributes</b>
+  <ul>
+    <li>types: comma separated device types, default TechemHKV,TechemWZ,ESA2000</li>
+    <li>file: the snapshot file, default &lt;name&gt;.snapshot in the directory of the statefile</li>
+    <li>keepStatefile: 0 leaves the readings of the saved devices out of the statefile at
+      shutdown, default 1</li>
+    <li>disable: 1 neither saves nor restores</li>
+    <li><a href="#readingFnAttributes">readingFnAttributes</a></li>
+  </ul>
+</ul>
+=end html
+=cut
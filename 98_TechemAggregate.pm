@@ -0,0 +1,287 @@
+###############################################################################
+# $Id: 98_TechemAggregate.pm $
+#
+# this module is part of fhem under the same license
+#
+# sums of the billing period readings of a group of Techem meters
+#
+# history
+# initial checkin
+#
+###############################################################################
+package main;
+
+use strict;
+use warnings;
+
+# member state: [current_period, previous_period, billing date],
+# sums per billing date: [current_period, previous_period, meters]
+use constant {
+  TAGG_CUR  => 0,
+  TAGG_PREV => 1,
+  TAGG_DATE => 2,
+  TAGG_N    => 2,
+};
+
+sub
+TechemAggregate_Initialize(@) {
+  my ($hash) = @_;
+
+  $hash->{DefFn}      = "TechemAggregate_Define";
+  $hash->{UndefFn}    = "TechemAggregate_Undef";
+  $hash->{SetFn}      = "TechemAggregate_Set";
+  $hash->{NotifyFn}   = "TechemAggregate_Notify";
+
+  $hash->{AttrList}   = $readingFnAttributes;
+
+  # meter name -> aggregates it belongs to
+  $hash->{helper}->{index} = {};
+  return undef;
+}
+
+sub
+TechemAggregate_Define(@) {
+  my ($hash, $def) = @_;
+  my ($name, $t, $re) = split(/\s+/, $def, 3);
+
+  return "Usage: define <name> TechemAggregate <regexp of meter names>" unless (defined($re));
+  eval { "" =~ m/^(?:$re)$/ };
+  return "bad regexp: $@" if ($@);
+
+  $hash->{MEMBERS} = $re;
+  $hash->{NOTIFYDEV} = "global";
+  if ($init_done) {
+    TechemAggregate_Undef($hash);
+    TechemAggregate_Scan($hash);
+  }
+  return undef;
+}
+
+sub
+TechemAggregate_Undef(@) {
+  my ($hash) = @_;
+  my $index = $modules{TechemAggregate}{helper}{index};
+  foreach my $m (keys %{$index}) {
+    $index->{$m} = [ grep { $_ != $hash } @{$index->{$m}} ];
+    delete $index->{$m} unless (@{$index->{$m}});
+  }
+  return undef;
+}
+
+sub
+TechemAggregate_Set(@) {
+  my ($hash, $name, $cmd, @args) = @_;
+  return "unknown command ($cmd): choose one of rescan:noArg" if ($cmd ne 'rescan');
+  TechemAggregate_Undef($hash);
+  TechemAggregate_Scan($hash);
+  return undef;
+}
+
+# a full scan only at startup, otherwise the defined, deleted or renamed
+# meter is added to or removed from this aggregate
+sub
+TechemAggregate_Notify(@) {
+  my ($hash, $ntfyDev) = @_;
+  return unless ($ntfyDev->{TYPE} eq 'Global');
+  my $changed = 0;
+  foreach my $event (@{$ntfyDev->{CHANGED}}) {
+    my @e = split(' ', $event);
+    next unless defined($e[0]);
+    if ($e[0] =~ /^(?:INITIALIZED|REREADCFG)$/) {
+      TechemAggregate_Undef($hash);
+      TechemAggregate_Scan($hash);
+      $changed = 0;
+    } elsif (($e[0] eq 'DEFINED') && defined($e[1])) {
+      $changed |= TechemAggregate_Add($hash, $e[1]);
+    } elsif (($e[0] eq 'DELETED') && defined($e[1])) {
+      $changed |= TechemAggregate_Remove($hash, $e[1]);
+    } elsif (($e[0] eq 'RENAMED') && defined($e[2])) {
+      $changed |= TechemAggregate_Remove($hash, $e[1]);
+      $changed |= TechemAggregate_Add($hash, $e[2]);
+    }
+  }
+  if ($changed) {
+    $hash->{MEMBERCOUNT} = scalar(keys %{$hash->{helper}->{m}});
+    TechemAggregate_Readings($hash);
+  }
+  return undef;
+}
+
+# the members of one aggregate and their sums, from the readings
+sub
+TechemAggregate_Scan(@) {
+  my ($agg) = @_;
+  $agg->{helper}->{m} = {};
+  $agg->{helper}->{sum} = {};
+  foreach my $d (sort keys %defs) {
+    TechemAggregate_Add($agg, $d);
+  }
+  $agg->{MEMBERCOUNT} = scalar(keys %{$agg->{helper}->{m}});
+  TechemAggregate_Readings($agg);
+  return undef;
+}
+
+# add a meter with its readings if it is a member, 1 if it was added
+sub
+TechemAggregate_Add(@) {
+  my ($agg, $d) = @_;
+  return 0 unless (defined($defs{$d}) && ($defs{$d}{TYPE} =~ /^Techem(?:HKV|WZ)$/) &&
+                   ($d =~ m/^(?:$agg->{MEMBERS})$/) && !defined($agg->{helper}->{m}->{$d}));
+  push @{$modules{TechemAggregate}{helper}{index}{$d}}, $agg;
+  my $date = ReadingsTimestamp($d, 'previous_period', undef);
+  TechemAggregate_Apply($agg, $d, ReadingsVal($d, 'current_period', undef),
+                        ReadingsVal($d, 'previous_period', undef), defined($date) ? substr($date, 0, 10) : undef);
+  return 1;
+}
+
+# remove a meter and its share of the sums, 1 if it was a member
+sub
+TechemAggregate_Remove(@) {
+  my ($agg, $d) = @_;
+  my $m = delete $agg->{helper}->{m}->{$d};
+  return 0 unless (defined($m));
+  TechemAggregate_Sub($agg->{helper}->{sum}, $m);
+  my $index = $modules{TechemAggregate}{helper}{index};
+  $index->{$d} = [ grep { $_ != $agg } @{$index->{$d} || []} ];
+  delete $index->{$d} unless (@{$index->{$d}});
+  return 1;
+}
+
+# called by TechemUtils_Commit (TechemHKV, TechemWZ) with the readings of one
+# telegram, before they are set
+sub
+TechemAggregate_Update(@) {
+  my ($hash, @r) = @_;
+  my $aggs = $modules{TechemAggregate}{helper}{index}{$hash->{NAME}};
+  return undef unless (defined($aggs));
+
+  my ($cur, $prev, $date);
+  foreach my $r (@r) {
+    if ($r->[0] eq 'current_period') {
+      $cur = $r->[1];
+    } elsif ($r->[0] eq 'previous_period') {
+      $prev = $r->[1];
+      $date = substr($r->[2], 0, 10) if (defined($r->[2]));
+    }
+  }
+  return undef unless (defined($cur) || defined($prev));
+
+  foreach my $agg (@{$aggs}) {
+    TechemAggregate_Apply($agg, $hash->{NAME}, $cur, $prev, $date);
+    TechemAggregate_Readings($agg);
+  }
+  return undef;
+}
+
+# Sums are kept per billing date: during the rollover some meters already
+# report the new billing period, the others still the old one. Only the
+# meters of the latest billing date are summed in the readings.
+sub
+TechemAggregate_Apply(@) {
+  my ($agg, $dev, $cur, $prev, $date) = @_;
+  my $sum = $agg->{helper}->{sum};
+  my $m = $agg->{helper}->{m}->{$dev};
+
+  if (defined($m)) {
+    TechemAggregate_Sub($sum, $m);
+  } else {
+    $m = $agg->{helper}->{m}->{$dev} = [ 0, 0, '' ];
+  }
+
+  $m->[TAGG_CUR]  = $cur  if (defined($cur) && ($cur =~ /^-?\d+(?:\.\d+)?$/));
+  $m->[TAGG_PREV] = $prev if (defined($prev) && ($prev =~ /^-?\d+(?:\.\d+)?$/));
+  $m->[TAGG_DATE] = $date if (defined($date));
+
+  my $s = $sum->{$m->[TAGG_DATE]} ||= [ 0, 0, 0 ];
+  $s->[TAGG_CUR]  += $m->[TAGG_CUR];
+  $s->[TAGG_PREV] += $m->[TAGG_PREV];
+  $s->[TAGG_N]++;
+  return undef;
+}
+
+# take the share of a meter out of the sums of its billing date
+sub
+TechemAggregate_Sub(@) {
+  my ($sum, $m) = @_;
+  my $s = $sum->{$m->[TAGG_DATE]};
+  $s->[TAGG_CUR]  -= $m->[TAGG_CUR];
+  $s->[TAGG_PREV] -= $m->[TAGG_PREV];
+  delete $sum->{$m->[TAGG_DATE]} unless (--$s->[TAGG_N]);
+  return undef;
+}
+
+sub
+TechemAggregate_Readings(@) {
+  my ($agg) = @_;
+  my $sum = $agg->{helper}->{sum};
+  my ($date) = sort { $b cmp $a } keys %{$sum};
+  my $s = defined($date) ? $sum->{$date} : [ 0, 0, 0 ];
+  my $pending = ($agg->{MEMBERCOUNT} || 0) - $s->[TAGG_N];
+  $pending = 0 if ($pending < 0);
+
+  readingsBeginUpdate($agg);
+  readingsBulkUpdate($agg, 'current_period', $s->[TAGG_CUR]);
+  readingsBulkUpdate($agg, 'previous_period', $s->[TAGG_PREV]);
+  readingsBulkUpdate($agg, 'previous_date', $date) if (defined($date) && $date ne '');
+  readingsBulkUpdate($agg, 'meters', $s->[TAGG_N]);
+  readingsBulkUpdate($agg, 'pending', $pending);
+  readingsBulkUpdate($agg, 'state', $s->[TAGG_CUR]);
+  readingsEndUpdate($agg, 1);
+  return undef;
+}
+
+1;
+
+=pod
+=item summary    sums of the billing period readings of Techem meters
+=item summary_DE Summen der Abrechnungszeitraum-Werte von Techem-Z&auml;hlern
+=begin html
+
+<a name="TechemAggregate"></a>
+<h3>TechemAggregate</h3>
+<ul>
+  This module sums the readings current_period and previous_period of a group of TechemHKV or
+  TechemWZ devices, e.g. per building or per riser. The sums are updated with the difference of
+  each received telegram. The meters are scanned at startup and by rescan, a meter defined,
+  deleted or renamed later is added or removed alone.
+  <br><br>
+  Meters roll over to a new billing period when their first telegram after the billing date
+  arrives. Until all meters have done so, only the meters of the latest billing date are summed;
+  the others are counted in the reading pending.
+  <br>
+  Do not mix heat cost allocators and heat or water meters in one group, their units differ.
+  <br><br>
+  <a name="TechemAggregate_Define"></a>
+  <b>Define</b>
+    <br>
+    <code>define &lt;name&gt; TechemAggregate &lt;regexp&gt;</code>
+    <br>
+    All TechemHKV and TechemWZ devices whose name matches the regexp are members, a meter can be
+    a member of several aggregates.
+    <br>
+    Example: <code>define house1_riserA TechemAggregate house1_A_.*</code>
+  <br><br>
+  <a name="TechemAggregate_Set"></a>
+  <b>Set</b>
+  <ul>
+    <li>rescan: compute the sums from the readings of the meters again</li>
+  </ul>
+  <br>
+  <a name="TechemAggregate_Readings"></a>
+  <b>Readings</b>
+  <ul>
+    <li>current_period: sum of the current billing period</li>
+    <li>previous_period: sum of the previous billing period</li>
+    <li>previous_date: the latest billing date</li>
+    <li>meters: meters in the sums</li>
+    <li>pending: meters still reporting an older billing period</li>
+  </ul>
+  <br>
+  <a name="TechemAggregate_Attr"></a>
+  <b>Attributes</b>
+  <ul>
+    <li><a href="#readingFnAttributes">readingFnAttributes</a></li>
+  </ul>
+</ul>
+=end html
+=cut
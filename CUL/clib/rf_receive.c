@@ -66,11 +66,31 @@ typedef struct {
   uint8_t hightime, lowtime;
 } wave_t;
 
+#ifdef HAS_RF_SOFTBIT
+// Soft decision: the bucket remembers its RF_WEAKBITS least confident bits
+// (smallest distance difference between the one and zero reference). If
+// all decoders fail, all combinations of them are flipped and checked
+// again as FS20/FHT or EM. Bit positions are uint8_t (byte index << 3 |
+// bit), so MAXMSG must not exceed 32.
+#define RF_WEAKBITS 3
+#if MAXMSG > 32
+#error "HAS_RF_SOFTBIT: weakpos needs MAXMSG <= 32"
+#endif
+#endif
+
 // One bucket to collect the "raw" bits
 typedef struct {
   uint8_t state, byteidx, sync, bitidx; 
   uint8_t data[MAXMSG];         // contains parity and checksum, but no sync
   wave_t zero, one; 
+  uint8_t lasthigh;             // last hightime, there is no rise after it
+#ifdef HAS_RF_PROFILE
+  uint8_t tdiff;                // tolerance from the sender profile, 0: TDIFF
+#endif
+#ifdef HAS_RF_SOFTBIT
+  uint8_t weakpos[RF_WEAKBITS]; // position of the least confident bits
+  uint8_t weakconf[RF_WEAKBITS];// their confidence, 0xff: unused
+#endif
 } bucket_t;
 
 // This struct has the bits for receive check
@@ -82,11 +102,179 @@ struct {
 } packetCheckValues;
 
 
+#ifndef NO_RF_STATS
+// Receiver counters, reported with Xs. They wrap at 65535.
+typedef struct {
+  uint16_t enq;                 // buckets queued for analysis
+  uint16_t ovf;                 // buckets dropped, all buckets in use
+  uint16_t noise;               // false alarms, too short for a bucket
+  uint16_t ok;                  // decoded buckets
+  uint16_t fail;                // buckets not decoded
+  uint16_t filtered;            // decoded, but not reported (repeat, FHT proto)
+  uint8_t  qmax;                // max. number of buckets in use
+  uint16_t soft;                // decoded after flipping weak bits
+  uint16_t comb;                // decoded by combining repeated copies
+  uint16_t ovfnew;              // overflow: the new bucket was dropped
+  uint16_t ovfold;              // overflow: the oldest queued was dropped
+  uint16_t ovfprio;             // overflow: a lower priority one was dropped
+  uint16_t calls;               // RfAnalyze_Task calls with queued buckets
+  uint8_t  permax;              // max. buckets analyzed in one call
+  uint16_t denied;              // not on the allow-list (counted as filtered)
+  uint16_t backoff;             // listen before talk: channel busy, backoff
+} rf_stats_t;
+static rf_stats_t rf_stats;
+#define RF_STAT(x) (rf_stats.x++)
+#else
+#define RF_STAT(x) ((void)0)
+#endif
+
+#ifdef HAS_RF_PROFILE
+// Timing profiles for known (drifting) senders, set with Xp. A profile
+// matches the first two raw bytes of a bucket, as shown in the REP_BITS
+// dump. The timings (TSCALE units, 0: keep the learned ones) replace the
+// learned ones and tdiff replaces TDIFF for the rest of the message.
+#define RF_PROFILES 4
+typedef struct {
+  uint8_t key[2];
+  wave_t zero, one;
+  uint8_t tdiff;                // 0: unused entry
+} rf_profile_t;
+static rf_profile_t rf_profile[RF_PROFILES];
+#endif
+
+#ifdef HAS_RF_COMBINE
+// FS20, FHT and EM send each frame 2-3 times. The last RF_COPIES buckets
+// which could not be decoded are kept for a majority vote with the next
+// one of the same length, if it arrives within RF_COPYTIME. The vote is
+// only accepted with a valid FS20/FHT or EM checksum; IT and the other
+// protocols without a checksum are not combined, a vote could invent a
+// code nobody sent.
+#define RF_COPIES   2
+#define RF_COPYTIME 38                  // in ticks, 0.3 sec as REPTIME
+typedef struct {
+  uint8_t state, byteidx, bitidx;
+  uint8_t time;                         // lower byte of ticks
+  uint8_t data[MAXMSG];
+} rf_copy_t;
+static rf_copy_t rf_copy[RF_COPIES];
+static bucket_t rf_vote;
+#endif
+
 static bucket_t bucket_array[RCV_BUCKETS];
 static uint8_t bucket_in;                 // Pointer to the in(terrupt) queue
 static uint8_t bucket_out;                // Pointer to the out (analyze) queue
 static uint8_t bucket_nrused;             // Number of unprocessed buckets
-static uint8_t oby, obuf[MAXMSG], nibble; // parity-stripped output
+
+#ifdef HAS_RF_OVERFLOW
+// Which bucket to drop if all are in use, set with Xo. The bucket
+// RfAnalyze_Task is working on (bucket_busy) is never dropped.
+#define RF_OVF_NEWEST   0               // the new one (default, as before)
+#define RF_OVF_OLDEST   1               // the oldest queued one
+#define RF_OVF_PRIO     2               // the one with the lowest rf_prio()
+#define RF_OVF_POLICIES 3
+static uint8_t rf_ovfpolicy;
+static volatile uint8_t bucket_busy;
+#endif
+
+#ifdef HAS_RF_DRAIN
+// RfAnalyze_Task analyzes up to rf_drain_max buckets per call, as long as
+// less than rf_drain_ticks (8ms) have passed. Set with Xn, 1 0: as before.
+// (Not Xd: Xd0..XdF set tx_report.)
+static uint8_t rf_drain_max = 1, rf_drain_ticks = 2;
+#endif
+static void rf_analyze_bucket(void);
+
+#ifdef HAS_RF_ALLOW
+// Allow-list for the reported FS20, FHT, ESA and IT messages, loaded with
+// Xw. It is a bloom filter over the message type and the two address bytes
+// (housecode, ESA code, first IT bytes); a few neighbours may pass, but no
+// listed device is dropped. Other message types are always reported. The
+// list is kept in RAM, the host has to load it again after a reset.
+#define RF_ALLOW_BITS 256               // filter size, hashes are uint8_t
+static uint8_t rf_allow[RF_ALLOW_BITS/8];
+static uint8_t rf_allow_on;             // 0: promiscuous
+static uint8_t rf_allow_nr;             // number of added entries
+#endif
+
+#ifdef HAS_RF_TRACE
+// Binary event trace, to debug the decoder without serial output from the
+// ISR. Events are written to a RAM ring from any context and dumped with
+// Xt. Xt<mm> selects the events with a bitmask of _BV(RF_TR_*) and clears
+// the ring; bit 0 freezes it after the first failed analysis, so it holds
+// the history of that bucket. Xt re-arms it with the last Xt<mm> mask.
+#define RF_TRACE_LEN    32              // events, power of 2
+#define RF_TR_FREEZE    0
+#define RF_TR_EDGE      1               // a: hightime, b: lowtime
+#define RF_TR_STATE     2               // sync done, a: state, b: sync bits
+#define RF_TR_RESET     3               // a: RF_RS_*, b: byteidx
+#define RF_TR_ENQ       4               // a: bucket_in, b: bucket_nrused
+#define RF_TR_DEQ       5               // a: bucket_out, b: state
+#define RF_TR_VERDICT   6               // a: datatype (0: failed), b: oby
+#define RF_TR_REPORT    7               // a: datatype, b: 1 reported, 0 filtered
+#define RF_RS_NOISE     1               // timeout with too few bits
+#define RF_RS_OVF       2               // timeout, no free bucket
+#define RF_RS_RANGE     3               // HMS/ESA bit time out of range
+#define RF_RS_FULL      4               // more than MAXMSG bytes
+#define RF_RS_WAVE      5               // bit matches neither wave
+typedef struct {
+  uint8_t ev, time, a, b;               // time: lower byte of ticks (8ms)
+} rf_trace_t;
+static rf_trace_t rf_trace_buf[RF_TRACE_LEN];
+static uint8_t rf_trace_in, rf_trace_nr;
+static uint8_t rf_trace_mask;
+static uint8_t rf_trace_arm;            // as set with Xt<mm>
+static void rf_trace(uint8_t ev, uint8_t a, uint8_t b);
+#define RF_TRACE(ev,a,b) rf_trace(ev, a, b)
+#else
+#define RF_TRACE(ev,a,b) ((void)0)
+#endif
+
+#ifdef HAS_RF_LBT
+// Listen before talk for rf_isreceiving(), set with Xl. Instead of the
+// bucket state (busy with any noise, blind to undecodable traffic) the
+// channel is busy if the cc1101 senses a carrier: RSSI above rf_lbt_thr
+// (raw register, dBm = raw/2 - 74) or the CCA bit of PKTSTATUS (as
+// configured in MCSM1). A busy channel stays busy for a random backoff of
+// 1..rf_lbt_backoff ticks, which Xl rounds down to a power of 2 in 1..64.
+// The FHT80b timeout is kept.
+#define RF_LBT_BUCKET   0               // bucket state, as before
+#define RF_LBT_RSSI     1
+#define RF_LBT_CCA      2
+#define RF_LBT_MODES    3
+static uint8_t rf_lbt_mode;
+static int8_t rf_lbt_thr = -32;         // -90dBm
+static uint8_t rf_lbt_backoff = 4;      // max. ticks, power of 2 <= 64
+static uint8_t rf_lbt_until;            // lower byte of ticks
+static uint8_t rf_lbt_busy;
+#endif
+
+#ifdef HAS_RF_FASTRX
+// TX->RX turnaround, set with Xr<mm>. Bit 0: fast return, set_txrestore
+// only strobes SRX if the receiver is on and was fully configured for the
+// current tx_report, instead of set_ccon() writing all registers again.
+// Whoever else reprograms the cc1101 (ccInitChip of asksin, moritz, IT and
+// rf_router, FastRF, the C/W register commands) does not know about this,
+// so the configuration registers are read back and compared with their
+// signature from the last full configuration.
+// Bit 1: measure the blind time, from set_txrestore until MARCSTATE is RX,
+// in us, with the clock timer (TCNT1 is reset by the edge ISR). Measuring
+// waits for RX, up to RF_BLIND_POLLS reads.
+#define RF_FASTRX_ON    _BV(0)
+#define RF_FASTRX_MEAS  _BV(1)
+#define RF_BLIND_POLLS  1000
+static uint8_t rf_fastrx;              // 0: as before
+static uint8_t rf_rx_valid;             // configured for rf_rx_report
+static uint8_t rf_rx_report;
+static uint16_t rf_rx_sig;              // rf_cfg_sig() of that configuration
+typedef struct {
+  uint16_t fast, full, timeout;         // turnarounds
+  uint16_t last, max;                   // blind time, us
+  uint32_t sum;
+} rf_blind_t;
+static rf_blind_t rf_blind;
+#endif
+static uint8_t oby, obuf[MAXMSG], nibble; // parity-stripped output, nibble:
+                                          // last byte is a half byte (KS300)
 static uint8_t roby, robuf[MAXMSG];       // for Repeat check: buffer and time
 static uint32_t reptime;
 #ifdef LONG_PULSE
@@ -96,9 +284,17 @@ static uint8_t hightime, lowtime;
 #endif
 
 static void addbit(bucket_t *b, uint8_t bit);
-static void delbit(bucket_t *b);
 
-static uint8_t wave_equals(wave_t *a, uint8_t htime, uint8_t ltime, uint8_t state);
+static uint8_t wave_equals(wave_t *a, uint8_t htime, uint8_t ltime, bucket_t *b);
+static uint8_t wave_diff(wave_t *a, uint8_t htime, uint8_t ltime);
+static uint8_t wave_tdiff(bucket_t *b);
+#ifdef HAS_RF_SOFTBIT
+static void rf_weakbit(bucket_t *b, uint8_t conf);
+#endif
+#ifdef HAS_RF_PROFILE
+static void rf_profile_apply(bucket_t *b);
+static void rf_profile_func(char *in);
+#endif
 #ifdef HAS_IT
 static uint8_t wave_equals_itV3(uint8_t htime, uint8_t ltime);
 #endif
@@ -119,6 +315,82 @@ tx_init(void)
   cc_on = 0;
 }
 
+#ifdef HAS_RF_FASTRX
+// Signature of the configuration registers up to FSCAL3, which (with
+// FSCAL2..0) is rewritten by every calibration.
+static uint16_t
+rf_cfg_sig(void)
+{
+  uint16_t s = 0;
+  CC1100_ASSERT;
+  cc1100_sendbyte(CC1100_READ_BURST);   // from IOCFG2
+  for(uint8_t i = 0; i < CC1100_FSCAL3; i++)
+    s = ((s << 1) | (s >> 15)) ^ cc1100_sendbyte(0);
+  CC1100_DEASSERT;
+  return s;
+}
+
+// Timer0 counts of the clock: ticks increments at each OCR0A compare.
+// Only differences are used, so the wrap of the product does not matter.
+static uint32_t
+rf_blind_now(void)
+{
+  uint32_t t;
+  uint8_t c, sreg = SREG;
+  cli();
+  t = ticks;
+  c = TCNT0;
+  if(bit_is_set(TIFR0, OCF0A) && c < OCR0A)     // compare ISR pending
+    t++;
+  SREG = sreg;
+  return t * (OCR0A+1) + c;
+}
+
+static void
+rf_blind_measure(uint32_t t0)
+{
+  static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  uint32_t t;
+  uint16_t i;
+  for(i = 0; i < RF_BLIND_POLLS; i++)
+    if((cc1100_readReg(CC1100_MARCSTATE) & 0x1f) == MARCSTATE_RX)
+      break;
+  if(i == RF_BLIND_POLLS) {
+    rf_blind.timeout++;
+    return;
+  }
+  t = (rf_blind_now() - t0) * prescale[TCCR0B & 7] / (F_CPU/1000000);
+  if(t > 0xffff)
+    t = 0xffff;
+  rf_blind.last = t;
+  if(t > rf_blind.max)
+    rf_blind.max = t;
+  rf_blind.sum += t;
+}
+
+// Xr: mm fast full timeout last max avg, Xr<mm>: set mode, clear
+static void
+rf_fastrx_func(char *in)
+{
+  if(in[0]) {
+    uint8_t m;
+    if(fromhex(in, &m, 1) != 1)
+      return;
+    rf_fastrx = m;
+    memset(&rf_blind, 0, sizeof(rf_blind));
+  }
+  uint16_t n = rf_blind.fast + rf_blind.full - rf_blind.timeout;
+  DH2(rf_fastrx);
+  DC(' '); DU(rf_blind.fast, 5);
+  DC(' '); DU(rf_blind.full, 5);
+  DC(' '); DU(rf_blind.timeout, 5);
+  DC(' '); DU(rf_blind.last, 5);
+  DC(' '); DU(rf_blind.max, 5);
+  DC(' '); DU(n ? rf_blind.sum/n : 0, 5);
+  DNL();
+}
+#endif
+
 void
 set_txrestore()
 {
@@ -131,8 +403,26 @@ set_txrestore()
   }
 #endif
   if(tx_report) {
+#ifdef HAS_RF_FASTRX
+    uint32_t t0 = (rf_fastrx & RF_FASTRX_MEAS) ? rf_blind_now() : 0;
+    if((rf_fastrx & RF_FASTRX_ON) && cc_on && rf_rx_valid &&
+       rf_rx_report == tx_report && rf_cfg_sig() == rf_rx_sig) {
+      ccRX();                           // the RX registers are unchanged
+      rf_blind.fast++;
+    } else {
+      set_ccon();
+      ccRX();
+      rf_rx_valid = 1;
+      rf_rx_report = tx_report;
+      rf_rx_sig = rf_cfg_sig();
+      rf_blind.full++;
+    }
+    if(rf_fastrx & RF_FASTRX_MEAS)
+      rf_blind_measure(t0);
+#else
     set_ccon();
     ccRX();
+#endif
 
   } else {
     set_ccoff();
@@ -140,6 +430,190 @@ set_txrestore()
   }
 }
 
+#ifdef HAS_RF_ALLOW
+static uint8_t
+rf_allow_hash(uint8_t seed, uint8_t type, uint8_t k0, uint8_t k1)
+{
+  seed = (seed ^ type) * 167;
+  seed = (seed ^ k0)   * 167;
+  seed = (seed ^ k1)   * 167;
+  return seed ^ (seed >> 4);
+}
+
+static uint8_t
+rf_allow_bit(uint8_t h, uint8_t set)
+{
+  if(set)
+    rf_allow[h>>3] |= _BV(h&7);
+  return rf_allow[h>>3] & _BV(h&7);
+}
+
+// Is the message in obuf allowed to be reported?
+static uint8_t
+rf_allowed(uint8_t type)
+{
+  uint8_t k = 0;
+
+  if(!rf_allow_on)
+    return 1;
+  switch(type) {
+    case TYPE_FS20:
+    case TYPE_FHT:
+#ifdef HAS_IT
+    case TYPE_IT:
+#endif
+      break;
+#ifdef HAS_ESA
+    case TYPE_ESA:
+      k = 1;                            // skip the sequence number
+      break;
+#endif
+    default:
+      return 1;
+  }
+  if(oby < k+2)
+    return 1;
+  return rf_allow_bit(rf_allow_hash(0x5a, type, obuf[k], obuf[k+1]), 0) &&
+         rf_allow_bit(rf_allow_hash(0xc3, type, obuf[k], obuf[k+1]), 0);
+}
+
+// Xw: status, Xw0: promiscuous, Xw1: filter, Xwc: clear,
+// Xw+<type><4 hex digits>: add, e.g. Xw+F1234 for the FS20 housecode 1234
+static void
+rf_allow_func(char *in)
+{
+  uint8_t hb[2];
+
+  if(in[0] == '0' || in[0] == '1') {
+    rf_allow_on = (in[0] == '1');
+
+  } else if(in[0] == 'c') {
+    memset(rf_allow, 0, sizeof(rf_allow));
+    rf_allow_nr = 0;
+
+  } else if(in[0] == '+' && in[1] && fromhex(in+2, hb, 2) == 2) {
+    rf_allow_bit(rf_allow_hash(0x5a, in[1], hb[0], hb[1]), 1);
+    rf_allow_bit(rf_allow_hash(0xc3, in[1], hb[0], hb[1]), 1);
+    if(rf_allow_nr < 255)
+      rf_allow_nr++;
+
+  }
+  DH2(rf_allow_on);
+  DU(rf_allow_nr, 4);
+  DNL();
+}
+#endif
+
+#ifdef HAS_RF_TRACE
+static void
+rf_trace(uint8_t ev, uint8_t a, uint8_t b)
+{
+  uint8_t sreg = SREG;
+  cli();                        // called from the ISRs and the task
+  if(rf_trace_mask & _BV(ev)) {
+    rf_trace_t *t = rf_trace_buf + rf_trace_in;
+    t->ev = ev;
+    t->time = (uint8_t)ticks;
+    t->a = a;
+    t->b = b;
+    rf_trace_in = (rf_trace_in+1) & (RF_TRACE_LEN-1);
+    if(rf_trace_nr < RF_TRACE_LEN)
+      rf_trace_nr++;
+    if(ev == RF_TR_VERDICT && !a && (rf_trace_mask & _BV(RF_TR_FREEZE)))
+      rf_trace_mask = _BV(RF_TR_FREEZE);
+  }
+  SREG = sreg;
+}
+
+// Xt: dump the events, oldest first, one "ev time a b" line each, clear
+// the ring and re-arm it. Xt<mm>: set the event mask and clear the ring.
+static void
+rf_trace_func(char *in)
+{
+  uint8_t mask, i, n;
+  uint8_t sreg = SREG;
+
+  if(in[0]) {
+    if(fromhex(in, &mask, 1) != 1)
+      return;
+    rf_trace_arm = mask;
+  } else {
+    mask = rf_trace_arm;        // a freeze left only the freeze bit
+  }
+
+  cli();
+  i = (rf_trace_in - rf_trace_nr) & (RF_TRACE_LEN-1);
+  n = rf_trace_nr;
+  rf_trace_mask = 0;            // nothing is added while dumping
+  SREG = sreg;
+
+  if(!in[0]) {
+    while(n--) {
+      rf_trace_t *t = rf_trace_buf + i;
+      DH2(t->ev);
+      DC(' ');
+      DH2(t->time);
+      DC(' ');
+      DH2(t->a);
+      DC(' ');
+      DH2(t->b);
+      DNL();
+      i = (i+1) & (RF_TRACE_LEN-1);
+    }
+  }
+
+  cli();
+  rf_trace_in = rf_trace_nr = 0;
+  rf_trace_mask = mask;
+  SREG = sreg;
+  if(in[0]) {
+    DH2(mask);
+    DNL();
+  }
+}
+#endif
+
+#ifndef NO_RF_STATS
+static void
+rf_stats_du(uint16_t v)
+{
+  DC(' ');
+  DU(v, 5);
+}
+
+// Xs: enq ovf noise ok fail filtered qmax nrused soft comb ovfnew ovfold
+//     ovfprio calls permax denied backoff
+// New counters are appended, the host relies on the order.
+static void
+rf_stats_func(void)
+{
+  rf_stats_t st;
+  uint8_t sreg = SREG;
+  cli();                        // the ISR updates them
+  st = rf_stats;
+  SREG = sreg;
+
+  rf_stats_du(st.enq);
+  rf_stats_du(st.ovf);
+  rf_stats_du(st.noise);
+  rf_stats_du(st.ok);
+  rf_stats_du(st.fail);
+  rf_stats_du(st.filtered);
+  rf_stats_du(st.qmax);
+  rf_stats_du(bucket_nrused);
+  rf_stats_du(st.soft);
+  rf_stats_du(st.comb);
+  rf_stats_du(st.ovfnew);
+  rf_stats_du(st.ovfold);
+  rf_stats_du(st.ovfprio);
+  rf_stats_du(st.calls);
+  rf_stats_du(st.permax);
+  rf_stats_du(st.denied);
+  rf_stats_du(st.backoff);
+  DNL();
+}
+#endif
+
 void
 set_txreport(char *in)
 {
@@ -150,7 +624,85 @@ set_txreport(char *in)
     return;
   }
 
+#ifndef NO_RF_STATS
+  if(in[1] == 's') {            // Receiver statistics
+    rf_stats_func();
+    return;
+  }
+#endif
+#ifdef HAS_RF_ALLOW
+  if(in[1] == 'w') {            // Allow-list, not a: Xa1 sets tx_report
+    rf_allow_func(in+2);
+    return;
+  }
+#endif
+#ifdef HAS_RF_DRAIN
+  if(in[1] == 'n') {            // Buckets / ticks per RfAnalyze_Task call
+    uint8_t hb[2];
+    if(fromhex(in+2, hb, 2) == 2 && hb[0]) {
+      rf_drain_max = hb[0];
+      rf_drain_ticks = hb[1];
+    }
+    DH2(rf_drain_max);
+    DC(' ');
+    DH2(rf_drain_ticks);
+    DNL();
+    return;
+  }
+#endif
+#ifdef HAS_RF_OVERFLOW
+  if(in[1] == 'o') {            // Bucket overflow policy
+    uint8_t pol;
+    if(in[2] && fromhex(in+2, &pol, 1) == 1 && pol < RF_OVF_POLICIES)
+      rf_ovfpolicy = pol;
+    DH2(rf_ovfpolicy);
+    DNL();
+    return;
+  }
+#endif
+#ifdef HAS_RF_PROFILE
+  if(in[1] == 'p') {            // Sender timing profiles
+    rf_profile_func(in+2);
+    return;
+  }
+#endif
+#ifdef HAS_RF_LBT
+  if(in[1] == 'l') {            // Listen before talk: mode threshold backoff
+    uint8_t hb[3];
+    if(fromhex(in+2, hb, 3) == 3 && hb[0] < RF_LBT_MODES) {
+      rf_lbt_mode = hb[0];
+      rf_lbt_thr = (int8_t)hb[1];
+      rf_lbt_backoff = 64;              // int8_t deadline compare
+      while(rf_lbt_backoff > 1 && rf_lbt_backoff > hb[2])
+        rf_lbt_backoff >>= 1;           // power of 2 for the TCNT1 mask
+      rf_lbt_busy = 0;
+    }
+    DH2(rf_lbt_mode);
+    DC(' ');
+    DH2((uint8_t)rf_lbt_thr);
+    DC(' ');
+    DH2(rf_lbt_backoff);
+    DNL();
+    return;
+  }
+#endif
+#ifdef HAS_RF_FASTRX
+  if(in[1] == 'r') {            // TX->RX turnaround, not f: Xf1 sets tx_report
+    rf_fastrx_func(in+2);
+    return;
+  }
+#endif
+#ifdef HAS_RF_TRACE
+  if(in[1] == 't') {            // Event trace
+    rf_trace_func(in+2);
+    return;
+  }
+#endif
+
   fromhex(in+1, &tx_report, 1);
+#ifdef HAS_RF_FASTRX
+  rf_rx_valid = 0;              // always configure fully here
+#endif
   set_txrestore();
 }
 
@@ -174,15 +726,15 @@ cksum2(uint8_t *buf, uint8_t len)               // EM
   return s;
 }
 
-uint8_t
-cksum3(uint8_t *buf, uint8_t len)               // KS300
-{
+static uint8_t
+cksum3_half(uint8_t *buf, uint8_t len, uint8_t half) // KS300, half: last
+{                                                    // byte is a half byte
   uint8_t x = 0, y = 5, cnt = 0;
   while(len) {
     uint8_t d = buf[--len];
     x ^= (d>>4);
     y += (d>>4);
-    if(!nibble || cnt) {
+    if(!half || cnt) {
       x ^= (d&0xf);
       y += (d&0xf);
     }
@@ -192,13 +744,18 @@ cksum3(uint8_t *buf, uint8_t len)               // KS300
   return (y<<4)|x;
 }
 
+uint8_t
+cksum3(uint8_t *buf, uint8_t len)               // KS300, as declared in
+{                                               // rf_receive.h
+  return cksum3_half(buf, len, nibble);
+}
+
 static uint8_t
-analyze(bucket_t *b, uint8_t t)
+analyze(bucket_t *b, uint8_t t)                     // FS20 / EM
 {
   uint8_t cnt=0, max, iby = 0;
   int8_t ibi=7, obi=7;
 
-  nibble = 0;
   oby = 0;
   max = b->byteidx*8+(7-b->bitidx);
   obuf[0] = 0;
@@ -210,22 +767,12 @@ analyze(bucket_t *b, uint8_t t)
       ibi=7;
     }
 
-    if(t == TYPE_KS300 && obi == 3) {                   // nibble check
-      if(!nibble) {
-        if(!bit)
-          return 0;
-        nibble = !nibble;
-        continue;
-      }
-      nibble = !nibble;
-    }
-
     if(obi == -1) {                                    // next byte
       if(t == TYPE_FS20) {
         if(parity_even_bit(obuf[oby]) != bit)
           return 0;
       }
-      if(t == TYPE_EM || t == TYPE_KS300) {
+      if(t == TYPE_EM) {
         if(!bit)
           return 0;
       }
@@ -236,7 +783,7 @@ analyze(bucket_t *b, uint8_t t)
       if(bit) {
         if(t == TYPE_FS20)
           obuf[oby] |= _BV(obi);
-        if(t == TYPE_EM || t == TYPE_KS300)            // LSB
+        if(t == TYPE_EM)                               // LSB
           obuf[oby] |= _BV(7-obi);
       }
       obi--;
@@ -246,14 +793,135 @@ analyze(bucket_t *b, uint8_t t)
     return 0;
   else if(t == TYPE_EM && obi == -1)                  // missing last stopbit
     oby++;
-  else if(nibble)                                     // half byte msg 
+
+  if(oby == 0)
+    return 0;
+  return 1;
+}
+
+// KS300 / S300: LSB nibbles, each followed by a 1 bit. As there is no last
+// rise, the last bit is not in the bucket: the caller passes it in lastbit.
+// The bucket is not modified, *half is set if the message ends with a half
+// byte.
+static uint8_t
+analyze_ks300(bucket_t *b, uint8_t lastbit, uint8_t *half)
+{
+  uint8_t cnt=0, max, iby = 0, nib = 0;
+  int8_t ibi=7, obi=7;
+
+  oby = 0;
+  max = b->byteidx*8+(7-b->bitidx);
+  obuf[0] = 0;
+  while(cnt <= max) {
+
+    uint8_t bit;                                       // Input bit
+    if(cnt++ == max) {
+      bit = lastbit;
+    } else {
+      bit = (b->data[iby] & _BV(ibi)) ? 1 : 0;
+      if(ibi-- == 0) {
+        iby++;
+        ibi=7;
+      }
+    }
+
+    if(obi == 3) {                                     // nibble check
+      if(!nib) {
+        if(!bit)
+          return 0;
+        nib = 1;
+        continue;
+      }
+      nib = 0;
+    }
+
+    if(obi == -1) {                                    // next byte
+      if(!bit)
+        return 0;
+      obuf[++oby] = 0;
+      obi = 7;
+
+    } else {                                           // Normal bits
+      if(bit)
+        obuf[oby] |= _BV(7-obi);
+      obi--;
+    }
+  }
+  if(nib)                                             // half byte msg 
     oby++;
+  *half = nib;
 
   if(oby == 0)
     return 0;
   return 1;
 }
 
+// FS20 / FHT: parity and checksum. Returns the datatype, the checksum byte
+// is not counted in oby.
+static uint8_t
+analyze_fs20(bucket_t *b)
+{
+  if(!analyze(b, TYPE_FS20))                // Can be FS10 (433Mhz) or FS20 (868MHz)
+    return 0;
+  oby--;                                    // Separate the checksum byte
+  if(oby < 4)
+    return 0;
+  uint8_t fs_csum = cksum1(6,obuf,oby);
+  if(fs_csum == obuf[oby])
+    return TYPE_FS20;
+
+  if(fs_csum+1 == obuf[oby]) {              // Repeater
+    obuf[oby] = fs_csum;                    // do not report if we get both
+    return TYPE_FS20;
+  }
+
+  if(cksum1(12, obuf, oby) == obuf[oby])
+    return TYPE_FHT;
+  return 0;
+}
+
+static uint8_t
+analyze_em(bucket_t *b)
+{
+  if(!analyze(b, TYPE_EM))
+    return 0;
+  oby--;                                 
+  if(oby == 9 && cksum2(obuf, oby) == obuf[oby])
+    return TYPE_EM;
+  return 0;
+}
+
+#ifdef HAS_RF_SOFTBIT
+static bucket_t soft_bucket;
+
+// Flip the combinations of the least confident bits (at most
+// 2^RF_WEAKBITS-1 tries) until FS20/FHT or EM decodes.
+static uint8_t
+analyze_soft(bucket_t *b)
+{
+  for(uint8_t m = 1; m < _BV(RF_WEAKBITS); m++) {
+    uint8_t i, datatype;
+    memcpy(&soft_bucket, b, sizeof(bucket_t));
+    for(i = 0; i < RF_WEAKBITS; i++) {
+      if(!(m & _BV(i)))
+        continue;
+      if(b->weakconf[i] == 0xff)        // unused slot
+        break;
+      uint8_t pos = b->weakpos[i];
+      soft_bucket.data[pos>>3] ^= _BV(7-(pos&7));
+    }
+    if(i < RF_WEAKBITS)
+      continue;
+    datatype = analyze_fs20(&soft_bucket);
+    if(!datatype)
+      datatype = analyze_em(&soft_bucket);
+    if(datatype)
+      return datatype;
+  }
+  return 0;
+}
+#endif
+
 typedef struct  {
   uint8_t *data;
   uint8_t byte, bit;
@@ -470,45 +1138,67 @@ void checkForRepeatedPackage(uint8_t *datatype, bucket_t *b) {
 #endif
 }
 
-//////////////////////////////////////////////////////////////////////
-void
-RfAnalyze_Task(void)
+// FHT handshake (ACK, CAN_XMIT, START_XMIT ...) or other protocol message.
+// These are not reported without REP_FHTPROTO.
+static uint8_t
+fht_isproto(uint8_t *msg)
 {
-  uint8_t datatype = 0;
-  bucket_t *b;
-
-  if(lowtime) {
-#ifndef NO_RF_DEBUG
-    if(tx_report & REP_LCDMON) {
-#ifdef HAS_LCD
-      lcd_txmon(hightime, lowtime);
-#else
-      uint8_t rssi = cc1100_readReg(CC1100_RSSI);    //  0..256
-      rssi = (rssi >= 128 ? rssi-128 : rssi+128);    // Swap
-      if(rssi < 64)                                  // Drop low and high 25%
-        rssi = 0;
-      else if(rssi >= 192)
-        rssi = 15;
-      else 
-        rssi = (rssi-80)>>3;
-      DC('a'+rssi);
-#endif
-    }
-    if(tx_report & REP_MONITOR) {
-      DC('r'); if(tx_report & REP_BINTIME) DC(hightime);
-      DC('f'); if(tx_report & REP_BINTIME) DC(lowtime);
-    }
-#endif // NO_RF_DEBUG
-    lowtime = 0;
+  switch(msg[2]) {
+    case FHT_ACK:
+    case FHT_ACK2:
+    case FHT_CAN_XMIT:
+    case FHT_CAN_RCV:
+    case FHT_START_XMIT:
+    case FHT_END_XMIT:
+      return 1;
   }
+  return ((msg[3] & 0x70) == 0x70);
+}
 
+#ifdef HAS_FHT_80b
+// FHT handshake messages for the FHT80b state machine. One of them is passed
+// to fht_hook per RfAnalyze_Task call, after the buckets of this call, so
+// the handshakes do not delay the analysis of the other buckets but are
+// still answered within the response time of the FHT80b. Other FHT
+// messages go to fht_hook directly, after the queued ones.
+#define FHT_QLEN   4
+#define FHT_MSGLEN 5                     // hc1 hc2 cmd status value
+static uint8_t fht_q[FHT_QLEN][FHT_MSGLEN];
+static uint8_t fht_qout, fht_qnr;
 
-  if(bucket_nrused == 0)
+static void
+fht_dequeue(void)
+{
+  if(fht_qnr == 0)
     return;
+  fht_hook(fht_q[fht_qout]);
+  fht_qnr--;
+  if(++fht_qout == FHT_QLEN)
+    fht_qout = 0;
+}
 
-  LED_ON();
+static void
+fht_enqueue(uint8_t *msg)
+{
+  if(fht_qnr == FHT_QLEN)               // full: the oldest one goes now
+    fht_dequeue();
+  uint8_t idx = fht_qout + fht_qnr;
+  if(idx >= FHT_QLEN)
+    idx -= FHT_QLEN;
+  memcpy(fht_q[idx], msg, FHT_MSGLEN);
+  fht_qnr++;
+}
+#endif
 
-  b = bucket_array + bucket_out;
+//////////////////////////////////////////////////////////////////////
+// Run all analyzers on the bucket, the result is in obuf/oby/nibble.
+// Returns the datatype or 0.
+static uint8_t
+rf_decode(bucket_t *b)
+{
+  uint8_t datatype = 0;
+
+  nibble = 0;
 
 #ifdef HAS_IT
   if(b->state == STATE_IT || b->state == STATE_ITV3) {
@@ -532,28 +1222,11 @@ RfAnalyze_Task(void)
   if(!datatype && analyze_esa(b))
     datatype = TYPE_ESA;
 #endif
-  if(!datatype && analyze(b, TYPE_FS20)) { // Can be FS10 (433Mhz) or FS20 (868MHz)
-    oby--;                                  // Separate the checksum byte
-    uint8_t fs_csum = cksum1(6,obuf,oby);
-    if(fs_csum == obuf[oby] && oby >= 4) {
-      datatype = TYPE_FS20;
+  if(!datatype)
+    datatype = analyze_fs20(b);
 
-    } else if(fs_csum+1 == obuf[oby] && oby >= 4) {     // Repeater
-      datatype = TYPE_FS20;
-      obuf[oby] = fs_csum;                  // do not report if we get both
-
-    } else if(cksum1(12, obuf, oby) == obuf[oby] && oby >= 4) {
-      datatype = TYPE_FHT;
-    } else {
-      datatype = 0;
-    }
-  }
-
-  if(!datatype && analyze(b, TYPE_EM)) {
-    oby--;                                 
-    if(oby == 9 && cksum2(obuf, oby) == obuf[oby])
-      datatype = TYPE_EM;
-  }
+  if(!datatype)
+    datatype = analyze_em(b);
 
   if(!datatype && analyze_hms(b))
     datatype = TYPE_HMS;
@@ -564,32 +1237,177 @@ RfAnalyze_Task(void)
 #endif
 
   if(!datatype) {
-    // As there is no last rise, we have to add the last bit by hand
-    addbit(b, wave_equals(&b->one, hightime, b->one.lowtime, b->state));
-    if(analyze(b, TYPE_KS300)) {
+    // As there is no last rise, the last bit is derived from lasthigh
+    uint8_t half;
+    uint8_t lastbit = wave_equals(&b->one, b->lasthigh, b->one.lowtime, b);
+    if(analyze_ks300(b, lastbit, &half)) {
       oby--;                                 
-      if(cksum3(obuf, oby) == obuf[oby-nibble])
+      if(cksum3_half(obuf, oby, half) == obuf[oby-half]) {
         datatype = TYPE_KS300;
+        nibble = half;
+      }
     }
-    if(!datatype)
-      delbit(b);
   }
 
 #ifdef HAS_HOERMANN
   // This protocol is not yet understood. It should be last in the row!
   if(!datatype && b->byteidx == 4 && b->bitidx == 4 &&
-     wave_equals(&b->zero, TSCALE(960), TSCALE(480), b->state)) {
+     wave_equals(&b->zero, TSCALE(960), TSCALE(480), b)) {
 
-    addbit(b, wave_equals(&b->one, hightime, TSCALE(480), b->state));
     for(oby=0; oby < 5; oby++)
       obuf[oby] = b->data[oby];
+    if(wave_equals(&b->one, b->lasthigh, TSCALE(480), b))
+      obuf[4] |= _BV(4);                    // the missing last bit
     datatype = TYPE_HRM;
   }
 #endif
+
+#ifdef HAS_RF_SOFTBIT
+  // only if all hard decoders failed: flipped bits of a good KS300 bucket
+  // could pass the FS20 or EM checksum
+  if(!datatype && b->state == STATE_COLLECT) {
+    datatype = analyze_soft(b);
+    if(datatype)
+      RF_STAT(soft);
+  }
+#endif
 #ifdef LONG_PULSE
   }
 #endif
 
+  return datatype;
+}
+
+#ifdef HAS_RF_COMBINE
+// The previous failed copies and the current one are combined bit by bit
+// (2 out of 3) and analyzed again as FS20/FHT or EM.
+static uint8_t
+rf_combine(bucket_t *b)
+{
+  uint8_t i, n = 0, datatype;
+  uint8_t now = (uint8_t)ticks;
+
+  if(b->state != STATE_COLLECT)
+    return 0;
+  if(b->byteidx < 2)                    // too short to be a frame
+    return 0;
+
+  for(i = 0; i < RF_COPIES; i++) {
+    rf_copy_t *c = rf_copy+i;
+    if(c->state == b->state &&
+       c->byteidx == b->byteidx && c->bitidx == b->bitidx &&
+       (uint8_t)(now - c->time) < RF_COPYTIME)
+      n++;
+  }
+
+  if(n == RF_COPIES) {
+    uint8_t *d0 = rf_copy[0].data, *d1 = rf_copy[1].data;
+    memcpy(&rf_vote, b, sizeof(bucket_t));
+    for(i = 0; i <= b->byteidx && i < MAXMSG; i++)
+      rf_vote.data[i] = (b->data[i] & (d0[i] | d1[i])) | (d0[i] & d1[i]);
+    rf_copy[0].state = rf_copy[1].state = STATE_RESET;     // used up
+    datatype = analyze_fs20(&rf_vote);
+    if(!datatype)
+      datatype = analyze_em(&rf_vote);
+    return datatype;
+  }
+
+  // Keep this copy, the oldest one is dropped
+  memmove(rf_copy+1, rf_copy, (RF_COPIES-1)*sizeof(rf_copy_t));
+  rf_copy[0].state   = b->state;
+  rf_copy[0].byteidx = b->byteidx;
+  rf_copy[0].bitidx  = b->bitidx;
+  rf_copy[0].time    = now;
+  memcpy(rf_copy[0].data, b->data, MAXMSG);
+  return 0;
+}
+#endif
+
+void
+RfAnalyze_Task(void)
+{
+  if(lowtime) {
+#ifndef NO_RF_DEBUG
+    if(tx_report & REP_LCDMON) {
+#ifdef HAS_LCD
+      lcd_txmon(hightime, lowtime);
+#else
+      uint8_t rssi = cc1100_readReg(CC1100_RSSI);    //  0..256
+      rssi = (rssi >= 128 ? rssi-128 : rssi+128);    // Swap
+      if(rssi < 64)                                  // Drop low and high 25%
+        rssi = 0;
+      else if(rssi >= 192)
+        rssi = 15;
+      else 
+        rssi = (rssi-80)>>3;
+      DC('a'+rssi);
+#endif
+    }
+    if(tx_report & REP_MONITOR) {
+      DC('r'); if(tx_report & REP_BINTIME) DC(hightime);
+      DC('f'); if(tx_report & REP_BINTIME) DC(lowtime);
+    }
+#endif // NO_RF_DEBUG
+    lowtime = 0;
+  }
+
+
+  if(bucket_nrused == 0) {
+#ifdef HAS_FHT_80b
+    fht_dequeue();
+#endif
+    return;
+  }
+
+#ifdef HAS_RF_DRAIN
+  uint8_t n = 0, start = (uint8_t)ticks;
+  do {
+    rf_analyze_bucket();
+    n++;
+  } while(bucket_nrused && n < rf_drain_max &&
+          (uint8_t)((uint8_t)ticks - start) < rf_drain_ticks);
+#else
+  rf_analyze_bucket();
+#endif
+#ifdef HAS_FHT_80b
+  fht_dequeue();
+#endif
+
+#ifndef NO_RF_STATS
+  rf_stats.calls++;
+#ifdef HAS_RF_DRAIN
+  if(n > rf_stats.permax)
+    rf_stats.permax = n;
+#else
+  rf_stats.permax = 1;
+#endif
+#endif
+}
+
+// Analyze and report the oldest queued bucket, then release it
+static void
+rf_analyze_bucket(void)
+{
+  uint8_t datatype;
+  bucket_t *b;
+
+  LED_ON();
+
+#ifdef HAS_RF_OVERFLOW
+  bucket_busy = 1;                      // before b, the ISR may shift the queue
+#endif
+  b = bucket_array + bucket_out;
+  RF_TRACE(RF_TR_DEQ, bucket_out, b->state);
+  datatype = rf_decode(b);
+#ifdef HAS_RF_COMBINE
+  if(!datatype) {
+    datatype = rf_combine(b);
+    if(datatype)
+      RF_STAT(comb);
+  }
+#endif
+  RF_TRACE(RF_TR_VERDICT, datatype, oby);
+
   if(datatype && (tx_report & REP_KNOWN)) {
 
     packetCheckValues.isrep = 0;
@@ -616,11 +1434,7 @@ RfAnalyze_Task(void)
     }
 
     if(datatype == TYPE_FHT && !(tx_report & REP_FHTPROTO) &&
-       oby > 4 &&
-       (obuf[2] == FHT_ACK        || obuf[2] == FHT_ACK2    ||
-        obuf[2] == FHT_CAN_XMIT   || obuf[2] == FHT_CAN_RCV ||
-        obuf[2] == FHT_START_XMIT || obuf[2] == FHT_END_XMIT ||
-        (obuf[3] & 0x70) == 0x70))
+       oby > 4 && fht_isproto(obuf))
       packetCheckValues.isrep = 1;
 
     checkForRepeatedPackage(&datatype, b);
@@ -630,6 +1444,14 @@ RfAnalyze_Task(void)
       packetCheckValues.packageOK = 0;
 #endif
 
+#ifdef HAS_RF_ALLOW
+    if(packetCheckValues.packageOK && !rf_allowed(datatype)) {
+      packetCheckValues.packageOK = 0;
+      RF_STAT(denied);
+    }
+#endif
+
+    RF_TRACE(RF_TR_REPORT, datatype, packetCheckValues.packageOK);
     if(packetCheckValues.packageOK) {
       DC(datatype);
       if(nibble)
@@ -641,10 +1463,17 @@ RfAnalyze_Task(void)
       if(tx_report & REP_RSSI)
         DH2(cc1100_readReg(CC1100_RSSI));
       DNL();
+    } else {
+      RF_STAT(filtered);
     }
 
   }
 
+  if(datatype)
+    RF_STAT(ok);
+  else
+    RF_STAT(fail);
+
 #ifndef NO_RF_DEBUG
   if(tx_report & REP_BITS) {
 
@@ -662,10 +1491,8 @@ RfAnalyze_Task(void)
       DH2(cc1100_readReg(CC1100_RSSI));
       DC(' ');
     }
-    if(b->bitidx != 7)
-      b->byteidx++;
-
-    for(uint8_t i=0; i < b->byteidx; i++)
+    uint8_t n = b->byteidx + (b->bitidx != 7 ? 1 : 0);
+    for(uint8_t i=0; i < n; i++)
        DH2(b->data[i]);
     DNL();
 
@@ -673,16 +1500,28 @@ RfAnalyze_Task(void)
 #endif
 
   b->state = STATE_RESET;
+#ifdef HAS_RF_PROFILE
+  b->tdiff = 0;
+#endif
   bucket_nrused--;
   bucket_out++;
   if(bucket_out == RCV_BUCKETS)
     bucket_out = 0;
+#ifdef HAS_RF_OVERFLOW
+  bucket_busy = 0;
+#endif
 
   LED_OFF();
 
 #ifdef HAS_FHT_80b
   if(datatype == TYPE_FHT) {
-    fht_hook(obuf);
+    if(oby > 4 && fht_isproto(obuf)) {
+      fht_enqueue(obuf);
+    } else {
+      while(fht_qnr)                    // keep the order
+        fht_dequeue();
+      fht_hook(obuf);
+    }
   }
 #endif
 }
@@ -692,6 +1531,9 @@ reset_input(void)
 {
   TIMSK1 = 0;
   bucket_array[bucket_in].state = STATE_RESET;
+#ifdef HAS_RF_PROFILE
+  bucket_array[bucket_in].tdiff = 0;
+#endif
 #if defined (HAS_IT) || defined (HAS_TCM97001)
   packetCheckValues.isnotrep = 0;
 #endif
@@ -700,6 +1542,68 @@ reset_input(void)
 //////////////////////////////////////////////////////////////////////
 // Timer Compare Interrupt Handler. If we are called, then there was no
 // data for SILENCE time, and we can put the data to be analysed
+#ifdef HAS_RF_OVERFLOW
+// Higher value: more valuable. ESA and HMS send rarely, IT and the other
+// long pulse remotes repeat their frames several times.
+static uint8_t
+rf_prio(uint8_t state)
+{
+  switch(state) {
+    case STATE_ESA:
+    case STATE_HMS:
+      return 3;
+    case STATE_COLLECT:                 // FS20, FHT, EM, KS300
+      return 2;
+  }
+  return 1;
+}
+
+// All buckets are in use: drop a queued one according to rf_ovfpolicy and
+// queue the new one. The newer buckets are moved down to close the gap, so
+// the order is kept and bucket_in stays. Returns 0 if nothing was dropped.
+static uint8_t
+rf_overflow(void)
+{
+  uint8_t i = bucket_out + bucket_busy;
+  uint8_t n = bucket_nrused - bucket_busy;
+  uint8_t victim, vprio = 0xff;
+
+  if(rf_ovfpolicy == RF_OVF_NEWEST || n == 0)
+    return 0;
+  if(i == RCV_BUCKETS)
+    i = 0;
+  victim = i;
+
+  if(rf_ovfpolicy == RF_OVF_PRIO) {
+    while(n--) {                        // the oldest of the lowest priority
+      uint8_t p = rf_prio(bucket_array[i].state);
+      if(p < vprio) {
+        vprio = p;
+        victim = i;
+      }
+      if(++i == RCV_BUCKETS)
+        i = 0;
+    }
+    if(rf_prio(bucket_array[bucket_in].state) <= vprio)
+      return 0;
+    RF_STAT(ovfprio);
+  } else {
+    RF_STAT(ovfold);
+  }
+
+  for(;;) {
+    i = victim+1;
+    if(i == RCV_BUCKETS)
+      i = 0;
+    memcpy(bucket_array+victim, bucket_array+i, sizeof(bucket_t));
+    if(i == bucket_in)
+      break;
+    victim = i;
+  }
+  return 1;
+}
+#endif
+
 ISR(TIMER1_COMPA_vect)
 {
 #ifdef LONG_PULSE
@@ -718,6 +1622,8 @@ ISR(TIMER1_COMPA_vect)
 
   if(bucket_array[bucket_in].state < STATE_COLLECT ||
      bucket_array[bucket_in].byteidx < 2) {    // false alarm
+    RF_STAT(noise);
+    RF_TRACE(RF_TR_RESET, RF_RS_NOISE, bucket_array[bucket_in].byteidx);
     reset_input();
     return;
 
@@ -729,36 +1635,74 @@ ISR(TIMER1_COMPA_vect)
     if(tx_report & REP_BITS)
       DS_P(PSTR("BOVF\r\n"));            // Bucket overflow
 #endif
+    RF_STAT(ovf);
+    RF_TRACE(RF_TR_RESET, RF_RS_OVF, bucket_array[bucket_in].byteidx);
 
+#ifdef HAS_RF_OVERFLOW
+    bucket_array[bucket_in].lasthigh = hightime;
+    if(!rf_overflow())
+      RF_STAT(ovfnew);
+#endif
     reset_input();
 
   } else {
 
+    bucket_array[bucket_in].lasthigh = hightime;
     bucket_nrused++;
+    RF_TRACE(RF_TR_ENQ, bucket_in, bucket_nrused);
     bucket_in++;
     if(bucket_in == RCV_BUCKETS)
       bucket_in = 0;
+#ifndef NO_RF_STATS
+    rf_stats.enq++;
+    if(bucket_nrused > rf_stats.qmax)
+      rf_stats.qmax = bucket_nrused;
+#endif
 
   }
 
 }
 
+// tolerated diff for this bucket
 static uint8_t
-wave_equals(wave_t *a, uint8_t htime, uint8_t ltime, uint8_t state)
+wave_tdiff(bucket_t *b)
 {
   uint8_t tdiffVal = TDIFF;
 #ifdef HAS_IT
-  if(state == STATE_IT)
+  if(b->state == STATE_IT)
     tdiffVal = TDIFFIT;
 #endif
+#ifdef HAS_RF_PROFILE
+  if(b->tdiff)
+    tdiffVal = b->tdiff;
+#endif
+  return tdiffVal;
+}
+
+// largest of the high, low and total diff to the reference, max. 255
+static uint8_t
+wave_diff(wave_t *a, uint8_t htime, uint8_t ltime)
+{
   int16_t dlow = a->lowtime-ltime;
   int16_t dhigh = a->hightime-htime;
   int16_t dcomplete  = (a->lowtime+a->hightime) - (ltime+htime);
-  if(dlow      < tdiffVal && dlow      > -tdiffVal &&
-     dhigh     < tdiffVal && dhigh     > -tdiffVal &&
-     dcomplete < tdiffVal && dcomplete > -tdiffVal)
-    return 1;
-  return 0;
+  if(dlow < 0)
+    dlow = -dlow;
+  if(dhigh < 0)
+    dhigh = -dhigh;
+  if(dcomplete < 0)
+    dcomplete = -dcomplete;
+  if(dhigh > dlow)
+    dlow = dhigh;
+  if(dcomplete > dlow)
+    dlow = dcomplete;
+  return (dlow > 255 ? 255 : dlow);
+}
+
+static uint8_t
+wave_equals(wave_t *a, uint8_t htime, uint8_t ltime, bucket_t *b)
+{
+  return wave_diff(a, htime, ltime) < wave_tdiff(b);
 }
 
 #ifdef HAS_IT
@@ -772,6 +1716,73 @@ wave_equals_itV3(uint8_t htime, uint8_t ltime)
 }
 #endif
 
+#ifdef HAS_RF_PROFILE
+static void
+rf_profile_apply(bucket_t *b)
+{
+  for(uint8_t i = 0; i < RF_PROFILES; i++) {
+    rf_profile_t *p = rf_profile+i;
+    if(!p->tdiff || p->key[0] != b->data[0] || p->key[1] != b->data[1])
+      continue;
+    if(p->zero.hightime)
+      b->zero = p->zero;
+    if(p->one.hightime)
+      b->one = p->one;
+    b->tdiff = p->tdiff;
+    return;
+  }
+}
+
+// Xp: list, Xpii: clear entry ii,
+// Xpiik0k1zhzloholtd: set entry ii (all hex, timings in TSCALE units)
+static void
+rf_profile_func(char *in)
+{
+  uint8_t hb[1+sizeof(rf_profile_t)];
+
+  if(in[0] == 0) {
+    for(uint8_t i = 0; i < RF_PROFILES; i++) {
+      uint8_t *p = (uint8_t *)(rf_profile+i);
+      DH2(i);
+      DC(' ');
+      for(uint8_t j = 0; j < sizeof(rf_profile_t); j++)
+        DH2(p[j]);
+      DNL();
+    }
+    return;
+  }
+
+  uint8_t n = fromhex(in, hb, sizeof(hb));
+  if(n < 1 || hb[0] >= RF_PROFILES || (n != 1 && n != sizeof(hb)))
+    return;
+  uint8_t sreg = SREG;
+  cli();                        // the ISR reads the table
+  if(n == 1)
+    memset(rf_profile+hb[0], 0, sizeof(rf_profile_t));
+  else
+    memcpy(rf_profile+hb[0], hb+1, sizeof(rf_profile_t));
+  SREG = sreg;
+}
+#endif
+
+#ifdef HAS_RF_SOFTBIT
+// Remember the position of the next bit if it is among the least confident
+static void
+rf_weakbit(bucket_t *b, uint8_t conf)
+{
+  uint8_t max = 0;
+  if(b->byteidx >= sizeof(b->data))     // addbit will reset
+    return;
+  for(uint8_t i = 1; i < RF_WEAKBITS; i++)
+    if(b->weakconf[i] > b->weakconf[max])
+      max = i;
+  if(conf < b->weakconf[max]) {
+    b->weakconf[max] = conf;
+    b->weakpos[max] = b->byteidx*8 + (7-b->bitidx);
+  }
+}
+#endif
+
 uint8_t
 makeavg(uint8_t i, uint8_t j)
 {
@@ -782,6 +1793,7 @@ static void
 addbit(bucket_t *b, uint8_t bit)
 {
   if(b->byteidx>=sizeof(b->data)){
+    RF_TRACE(RF_TR_RESET, RF_RS_FULL, b->byteidx);
     reset_input();
     return;
   }
@@ -806,15 +1818,6 @@ check_rf_sync(uint8_t l, uint8_t s)
           l > s);
 }
 
-static void
-delbit(bucket_t *b)
-{
-  if(b->bitidx++ == 7) {           // prev byte
-    b->bitidx = 0;
-    b->byteidx--;
-  }
-}
-
 //////////////////////////////////////////////////////////////////////
 // "Edge-Detected" Interrupt Handler
 ISR(CC1100_INTVECT)
@@ -844,6 +1847,7 @@ ISR(CC1100_INTVECT)
     if(c < TSCALE(750))
       return;
     if(c > TSCALE(1250)) {
+      RF_TRACE(RF_TR_RESET, RF_RS_RANGE, b->byteidx);
       reset_input();
       return;
     }
@@ -854,6 +1858,7 @@ ISR(CC1100_INTVECT)
     if(c < TSCALE(375))
       return;
     if(c > TSCALE(625)) {
+      RF_TRACE(RF_TR_RESET, RF_RS_RANGE, b->byteidx);
       reset_input();
       return;
     }
@@ -877,6 +1882,7 @@ ISR(CC1100_INTVECT)
 
   lowtime = c-hightime;
   TCNT1 = 0;                          // restart timer
+  RF_TRACE(RF_TR_EDGE, hightime, lowtime);
 
 #ifdef HAS_IT
   if(b->state == STATE_IT || b->state == STATE_ITV3) {
@@ -994,6 +2000,9 @@ retry_sync:
     b->byteidx = 0;
     b->bitidx  = 7;
     b->data[0] = 0;
+#ifdef HAS_RF_SOFTBIT
+    memset(b->weakconf, 0xff, RF_WEAKBITS);
+#endif
     return;
   } else
 #endif
@@ -1007,7 +2016,7 @@ retry_sync:
 
   } else if(b->state == STATE_SYNC) {   // sync: lots of zeroes
 
-    if(wave_equals(&b->zero, hightime, lowtime, b->state)) {
+    if(wave_equals(&b->zero, hightime, lowtime, b)) {
       b->zero.hightime = makeavg(b->zero.hightime, hightime);
       b->zero.lowtime  = makeavg(b->zero.lowtime,  lowtime);
       b->sync++;
@@ -1040,8 +2049,12 @@ retry_sync:
       b->byteidx = 0;
       b->bitidx  = 7;
       b->data[0] = 0;
+#ifdef HAS_RF_SOFTBIT
+      memset(b->weakconf, 0xff, RF_WEAKBITS);
+#endif
 
       TIMSK1 = _BV(OCIE1A);             // On timeout analyze the data
+      RF_TRACE(RF_TR_STATE, b->state, b->sync);
 
     } else {                            // too few sync bits
       b->state = STATE_RESET;
@@ -1086,28 +2099,75 @@ retry_sync:
     } else
 #endif 
 
-    // STATE_COLLECT , STATE_IT
-    if(wave_equals(&b->one, hightime, lowtime, b->state)) {
-      addbit(b, 1);
-      b->one.hightime = makeavg(b->one.hightime, hightime);
-      b->one.lowtime  = makeavg(b->one.lowtime,  lowtime);
-    } else if(wave_equals(&b->zero, hightime, lowtime, b->state)) {
-      addbit(b, 0);
-      b->zero.hightime = makeavg(b->zero.hightime, hightime);
-      b->zero.lowtime  = makeavg(b->zero.lowtime,  lowtime);
-    } else {
-        if (b->state!=STATE_IT) 
-      reset_input();
+    { // STATE_COLLECT , STATE_IT
+      uint8_t td = wave_tdiff(b);
+      uint8_t d1 = wave_diff(&b->one,  hightime, lowtime);
+      uint8_t d0 = wave_diff(&b->zero, hightime, lowtime);
+      if(d1 < td) {
+#ifdef HAS_RF_SOFTBIT
+        rf_weakbit(b, d0 > d1 ? d0-d1 : 0);   // margin to the zero wave
+#endif
+        addbit(b, 1);
+        b->one.hightime = makeavg(b->one.hightime, hightime);
+        b->one.lowtime  = makeavg(b->one.lowtime,  lowtime);
+      } else if(d0 < td) {
+#ifdef HAS_RF_SOFTBIT
+        rf_weakbit(b, d1-d0);
+#endif
+        addbit(b, 0);
+        b->zero.hightime = makeavg(b->zero.hightime, hightime);
+        b->zero.lowtime  = makeavg(b->zero.lowtime,  lowtime);
+      } else {
+        if (b->state!=STATE_IT) {
+          RF_TRACE(RF_TR_RESET, RF_RS_WAVE, b->byteidx);
+          reset_input();
+        }
+        return;
+      }
     }
 
+#ifdef HAS_RF_PROFILE
+    if(b->byteidx == 2 && b->bitidx == 7)      // profile key complete
+      rf_profile_apply(b);
+#endif
   }
 
 }
 
+#ifdef HAS_RF_LBT
+static uint8_t
+rf_lbt_sense(void)
+{
+  if(rf_lbt_busy && (int8_t)(rf_lbt_until - (uint8_t)ticks) > 0)
+    return 1;                           // in backoff
+  rf_lbt_busy = 0;
+  if(!cc_on)                            // receiver off, nothing to sense
+    return 0;
+
+  uint8_t busy;
+  if(rf_lbt_mode == RF_LBT_CCA)
+    busy = !(cc1100_readReg(CC1100_PKTSTATUS) & 0x10);  // CCA: channel clear
+  else
+    busy = ((int8_t)cc1100_readReg(CC1100_RSSI) > rf_lbt_thr);
+  if(busy) {
+    // random 1..rf_lbt_backoff ticks, the timer is free running enough
+    rf_lbt_until = (uint8_t)ticks + 1 + (TCNT1 & (rf_lbt_backoff-1));
+    rf_lbt_busy = 1;
+    RF_STAT(backoff);
+  }
+  return busy;
+}
+#endif
+
 uint8_t
 rf_isreceiving()
 {
+#ifdef HAS_RF_LBT
+  uint8_t r = (rf_lbt_mode == RF_LBT_BUCKET ?
+               bucket_array[bucket_in].state != STATE_RESET : rf_lbt_sense());
+#else
   uint8_t r = (bucket_array[bucket_in].state != STATE_RESET);
+#endif
 #ifdef HAS_FHT_80b
   r = (r || fht80b_timeout != FHT_TIMER_DISABLED);
 #endif
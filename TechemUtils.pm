@@ -0,0 +1,53 @@
+###############################################################################
+# $Id: TechemUtils.pm $
+#
+# this module is part of fhem under the same license
+#
+# helpers shared by 32_TechemHKV.pm and 32_TechemWZ.pm, installed to FHEM/
+# next to them and loaded with "use TechemUtils;"
+#
+# history
+# initial checkin
+#
+###############################################################################
+package main;
+
+use strict;
+use warnings;
+
+# Update readings in one cycle, @r: [reading, value, timestamp]. A timestamp
+# back-dates the reading and its event, undef is now. Readings with the same
+# timestamp are updated together, .updateTimestamp is set and the events
+# are back-dated (CHANGETIME) once per timestamp, not per reading.
+sub
+TechemUtils_Commit(@) {
+  my ($hash, @r) = @_;
+  return undef unless (@r);
+  # keep the sums of 98_TechemAggregate up to date
+  TechemAggregate_Update($hash, @r) if (defined(&TechemAggregate_Update));
+
+  # group by timestamp, in the order of the first reading of each
+  my (@ts, %g);
+  foreach my $r (@r) {
+    my $ts = defined($r->[2]) ? $r->[2] : '';
+    push @ts, $ts unless (exists($g{$ts}));
+    push @{$g{$ts}}, $r;
+  }
+
+  delete $hash->{CHANGETIME}; # clean up, workaround for fhem prior http://forum.fhem.de/index.php/topic,47474.msg391964.html#msg391964
+  readingsBeginUpdate($hash);
+  my $now = $hash->{".updateTimestamp"};
+  foreach my $ts (@ts) {
+    my $first = scalar(@{$hash->{CHANGED} || []});
+    $hash->{".updateTimestamp"} = length($ts) ? $ts : $now;
+    readingsBulkUpdate($hash, $_->[0], $_->[1]) foreach (@{$g{$ts}});
+    next unless (length($ts));
+    # only the events of this group, readings without event add none
+    $hash->{CHANGETIME}->[$_] = $ts foreach ($first .. $#{$hash->{CHANGED} || []});
+  }
+  $hash->{".updateTimestamp"} = $now;
+  readingsEndUpdate($hash, 1);
+  return undef;
+}
+
+1;
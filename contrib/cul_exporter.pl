@@ -0,0 +1,334 @@
+#!/usr/bin/perl
+###############################################################################
+#
+# cul_exporter.pl: serve CUL receiver counters as text metrics on localhost
+#
+# this script is part of fhem under the same license
+#
+# Every stick is polled with "X" (tx_report and credit_10ms), "t" (uptime
+# in 1/125s, to detect resets) and "Xs" (bucket, queue and decode counters,
+# see set_txreport in rf_receive.c).
+# Received messages on the same line are counted per message type.
+# All IO is non-blocking in one select loop; HTTP clients get the last
+# complete page, they never wait for a stick.
+#
+# usage:
+#   cul_exporter.pl [-l 127.0.0.1:9117] [-i 15] <name>=<device> ...
+#   device: /dev/ttyACM0@38400 or host:port (e.g. CUNO or ser2net)
+#
+# The stick must not be opened by fhem at the same time, use a network
+# attached stick or a serial multiplexer if both need it.
+#
+###############################################################################
+
+use strict;
+use warnings;
+
+use Fcntl;
+use IO::Select;
+use IO::Socket::INET;
+use Getopt::Std;
+use Time::HiRes qw(time);
+
+my %opts;
+getopts('l:i:', \%opts) && @ARGV or die <<"EOF";
+usage: $0 [-l 127.0.0.1:9117] [-i 15] <name>=<device> ...
+  device: /dev/ttyACM0\@38400 or host:port
+EOF
+
+my $listen   = $opts{l} || '127.0.0.1:9117';
+my $interval = $opts{i} || 15;
+my $timeout  = 3;
+
+# fields of the Xs reply in firmware order: name, type, help
+my @rfstats = (
+  [ 'cul_rf_buckets_total',          'counter', 'Buckets queued for analysis' ],
+  [ 'cul_rf_bucket_overflows_total', 'counter', 'Buckets dropped because all buckets were in use' ],
+  [ 'cul_rf_noise_total',            'counter', 'Receptions too short for a bucket' ],
+  [ 'cul_rf_decoded_total',          'counter', 'Buckets decoded' ],
+  [ 'cul_rf_undecoded_total',        'counter', 'Buckets not decoded' ],
+  [ 'cul_rf_filtered_total',         'counter', 'Decoded buckets not reported (repeats, FHT protocol)' ],
+  [ 'cul_rf_queue_max',              'gauge',   'Max. buckets in use since reset' ],
+  [ 'cul_rf_queue_used',             'gauge',   'Buckets in use' ],
+  [ 'cul_rf_soft_recovered_total',   'counter', 'Buckets decoded after flipping weak bits' ],
+  [ 'cul_rf_combined_total',         'counter', 'Buckets decoded by a majority vote of repeated copies' ],
+  [ 'cul_rf_overflow_newest_total',  'counter', 'Overflows where the new bucket was dropped' ],
+  [ 'cul_rf_overflow_oldest_total',  'counter', 'Overflows where the oldest queued bucket was dropped' ],
+  [ 'cul_rf_overflow_prio_total',    'counter', 'Overflows where a lower priority bucket was dropped' ],
+  [ 'cul_rf_analyze_calls_total',    'counter', 'Analyzer calls with queued buckets' ],
+  [ 'cul_rf_analyze_per_call_max',   'gauge',   'Max. buckets analyzed in one call since reset' ],
+  [ 'cul_rf_denied_total',           'counter', 'Decoded messages not on the allow-list' ],
+  [ 'cul_rf_lbt_backoffs_total',     'counter', 'Listen before talk: channel busy, send deferred' ],
+);
+
+my (@sticks, %byfh);
+foreach my $arg (@ARGV) {
+  my ($name, $dev) = split(/=/, $arg, 2);
+  die "bad stick $arg, expected <name>=<device>\n" unless (defined($dev) && length($name));
+  push @sticks, { NAME => $name, DEV => $dev, up => 0, errors => 0, resets => 0, rf => [], wrap => [], msg => {} };
+}
+
+my $server = IO::Socket::INET->new(LocalAddr => $listen, Listen => 8, ReuseAddr => 1, Blocking => 0)
+  or die "cannot listen on $listen: $!\n";
+my $sel = IO::Select->new($server);
+my %clients;
+
+# the page served to HTTP clients, replaced as a whole after each scrape
+my $page = "";
+
+sub
+Stick_Open(@) {
+  my ($s) = @_;
+  my $fh;
+  if ($s->{DEV} =~ m/^(.+)@(\d+)$/) {
+    my ($dev, $baud) = ($1, $2);
+    system('stty', '-F', $dev, $baud, qw(raw -echo -echoe -echok -icanon -hupcl)) == 0 or return 0;
+    sysopen($fh, $dev, O_RDWR|O_NOCTTY|O_NONBLOCK) or return 0;
+  } else {
+    # connect in the background, the first poll is skipped
+    $fh = IO::Socket::INET->new(PeerAddr => $s->{DEV}, Blocking => 0) or return 0;
+  }
+  $s->{FH} = $fh;
+  $s->{buf} = '';
+  $s->{state} = 'idle';
+  $s->{up} = 1;
+  $byfh{fileno($fh)} = $s;
+  $sel->add($fh);
+  return 1;
+}
+
+sub
+Stick_Close(@) {
+  my ($s) = @_;
+  return unless defined($s->{FH});
+  $sel->remove($s->{FH});
+  delete $byfh{fileno($s->{FH})};
+  close($s->{FH});
+  delete $s->{FH};
+  $s->{up} = 0;
+}
+
+sub
+Stick_Write(@) {
+  my ($s, $cmd) = @_;
+  my $n = syswrite($s->{FH}, "$cmd\n");
+  unless (defined($n) && $n == length($cmd) + 1) {
+    $s->{errors}++;
+    Stick_Close($s);
+    return 0;
+  }
+  $s->{deadline} = time() + $timeout;
+  return 1;
+}
+
+sub
+Stick_Poll(@) {
+  my ($s) = @_;
+  if (!defined($s->{FH})) {
+    $s->{errors}++ unless (Stick_Open($s));
+    return if ($s->{DEV} !~ m/@\d+$/);
+  }
+  if ($s->{state} ne 'idle') {
+    # previous scrape did not finish
+    $s->{errors}++;
+  }
+  $s->{state} = 'X' if (Stick_Write($s, 'X'));
+}
+
+# counters of the stick are 16 bit, keep them monotonic. After a reset of
+# the stick they start at 0 again, the new value is the increment.
+sub
+Stick_Counter(@) {
+  my ($s, $i, $v) = @_;
+  my $last = $s->{wrap}->[$i];
+  if (!defined($last)) {
+    $s->{rf}->[$i] = $v;
+  } elsif ($s->{reset}) {
+    $s->{rf}->[$i] += $v;
+  } else {
+    $s->{rf}->[$i] += ($v - $last) & 0xFFFF;
+  }
+  $s->{wrap}->[$i] = $v;
+}
+
+sub
+Stick_Line(@) {
+  my ($s, $line) = @_;
+  if (($s->{state} eq 'X') && ($line =~ m/^([0-9A-F]{2})\s+(\d+)$/)) {
+    $s->{txreport} = hex($1);
+    $s->{credit} = $2;
+    $s->{state} = 't' if (Stick_Write($s, 't'));
+  } elsif (($s->{state} eq 't') && ($line =~ m/^([0-9A-F]{8})$/)) {
+    # the uptime only goes back if the stick was reset (or after 397 days)
+    my $up = hex($1);
+    $s->{reset} = (defined($s->{uptime}) && ($up < $s->{uptime})) ? 1 : 0;
+    $s->{resets}++ if ($s->{reset});
+    $s->{uptime} = $up;
+    $s->{state} = 'Xs' if (Stick_Write($s, 'Xs'));
+  } elsif (($s->{state} eq 'Xs') && ($line =~ m/^(?:\s+\d+)+$/)) {
+    my @v = split(' ', $line);
+    for (my $i = 0; $i < @v && $i < @rfstats; $i++) {
+      if ($rfstats[$i]->[1] eq 'counter') {
+        Stick_Counter($s, $i, $v[$i]);
+      } else {
+        $s->{rf}->[$i] = $v[$i];
+      }
+    }
+    $s->{state} = 'idle';
+    $s->{scraped} = time();
+    Metrics_Build();
+  } elsif ($line =~ m/^([A-Za-z])[0-9A-Fa-f]/) {
+    # received message, first char is the type as sent by RfAnalyze_Task
+    $s->{msg}->{$1}++;
+  }
+}
+
+sub
+Stick_Read(@) {
+  my ($s) = @_;
+  my $buf;
+  my $n = sysread($s->{FH}, $buf, 4096);
+  if (!defined($n) || $n == 0) {
+    return if (!defined($n) && $!{EAGAIN});
+    $s->{errors}++;
+    Stick_Close($s);
+    Metrics_Build();
+    return;
+  }
+  $s->{buf} .= $buf;
+  while ($s->{buf} =~ s/^([^\n]*)\n//) {
+    my $line = $1;
+    $line =~ s/\r$//;
+    Stick_Line($s, $line) if (length($line));
+  }
+}
+
+sub
+Metrics_Build() {
+  my @p;
+  my $m = sub {
+    my ($name, $type, $help, @v) = @_;
+    push @p, "# HELP $name $help", "# TYPE $name $type";
+    push @p, @v;
+  };
+
+  $m->('cul_up', 'gauge', 'Stick connected',
+       map { "cul_up{stick=\"$_->{NAME}\"} $_->{up}" } @sticks);
+  $m->('cul_scrape_errors_total', 'counter', 'Failed or incomplete scrapes',
+       map { "cul_scrape_errors_total{stick=\"$_->{NAME}\"} $_->{errors}" } @sticks);
+  my @have = grep { defined($_->{credit}) } @sticks;
+  $m->('cul_tx_report', 'gauge', 'Report flags set with X',
+       map { "cul_tx_report{stick=\"$_->{NAME}\"} $_->{txreport}" } @have);
+  $m->('cul_resets_total', 'counter', 'Resets of the stick, seen as a lower uptime',
+       map { "cul_resets_total{stick=\"$_->{NAME}\"} $_->{resets}" } @sticks);
+  $m->('cul_credit_10ms', 'gauge', 'Remaining send credit (duty cycle) in 10ms',
+       map { "cul_credit_10ms{stick=\"$_->{NAME}\"} $_->{credit}" } @have);
+
+  for (my $i = 0; $i < @rfstats; $i++) {
+    my ($name, $type, $help) = @{$rfstats[$i]};
+    my @v;
+    my $sum = 0;
+    foreach my $s (grep { defined($_->{rf}->[$i]) } @sticks) {
+      push @v, "$name\{stick=\"$s->{NAME}\"\} $s->{rf}->[$i]";
+      $sum += $s->{rf}->[$i];
+    }
+    next unless (@v);
+    push @v, "$name\{stick=\"all\"\} $sum" if ($type eq 'counter');
+    $m->($name, $type, $help, @v);
+  }
+
+  my (@v, %sum);
+  foreach my $s (@sticks) {
+    foreach my $t (sort keys %{$s->{msg}}) {
+      push @v, "cul_messages_total{stick=\"$s->{NAME}\",type=\"$t\"} $s->{msg}->{$t}";
+      $sum{$t} += $s->{msg}->{$t};
+    }
+  }
+  push @v, map { "cul_messages_total{stick=\"all\",type=\"$_\"} $sum{$_}" } sort keys %sum;
+  $m->('cul_messages_total', 'counter', 'Received messages by type', @v) if (@v);
+
+  $page = join("\n", @p)."\n";
+}
+
+sub
+Client_Accept() {
+  my $c = $server->accept() or return;
+  $c->blocking(0);
+  $clients{fileno($c)} = { FH => $c, in => '', out => undef, since => time() };
+  $sel->add($c);
+}
+
+sub
+Client_Close(@) {
+  my ($c) = @_;
+  $sel->remove($c->{FH});
+  delete $clients{fileno($c->{FH})};
+  close($c->{FH});
+}
+
+sub
+Client_Read(@) {
+  my ($c) = @_;
+  my $buf;
+  my $n = sysread($c->{FH}, $buf, 4096);
+  if (!defined($n) || $n == 0) {
+    Client_Close($c) unless (!defined($n) && $!{EAGAIN});
+    return;
+  }
+  $c->{in} .= $buf;
+  return unless ($c->{in} =~ m/\r?\n\r?\n/);
+  my $body = $page;
+  my $status = ($c->{in} =~ m/^GET /)?'200 OK':'405 Method Not Allowed';
+  $body = '' unless ($status =~ /^200/);
+  $c->{out} = "HTTP/1.0 $status\r\n".
+              "Content-Type: text/plain; version=0.0.4\r\n".
+              "Content-Length: ".length($body)."\r\n".
+              "Connection: close\r\n\r\n".$body;
+  Client_Write($c);
+}
+
+sub
+Client_Write(@) {
+  my ($c) = @_;
+  my $n = syswrite($c->{FH}, $c->{out});
+  if (!defined($n)) {
+    Client_Close($c) unless ($!{EAGAIN});
+    return;
+  }
+  substr($c->{out}, 0, $n) = '';
+  Client_Close($c) unless (length($c->{out}));
+}
+
+Metrics_Build();
+my $next = 0;
+while (1) {
+  my $now = time();
+  if ($now >= $next) {
+    Stick_Poll($_) foreach (@sticks);
+    $next = $now + $interval;
+  }
+  foreach my $s (@sticks) {
+    next unless (defined($s->{FH}) && ($s->{state} ne 'idle') && ($now > $s->{deadline}));
+    $s->{errors}++;
+    $s->{state} = 'idle';
+  }
+  foreach my $c (values %clients) {
+    Client_Close($c) if ($now - $c->{since} > 10);
+  }
+
+  my $wsel = IO::Select->new(map { $_->{FH} } grep { defined($_->{out}) } values %clients);
+  my ($r, $w) = IO::Select->select($sel, $wsel, undef, 1);
+  foreach my $fh (@{$r || []}) {
+    if ($fh == $server) {
+      Client_Accept();
+    } elsif (defined($byfh{fileno($fh)})) {
+      Stick_Read($byfh{fileno($fh)});
+    } elsif (defined($clients{fileno($fh)})) {
+      Client_Read($clients{fileno($fh)});
+    }
+  }
+  foreach my $fh (@{$w || []}) {
+    my $c = $clients{fileno($fh)};
+    Client_Write($c) if (defined($c) && defined($c->{out}));
+  }
+}
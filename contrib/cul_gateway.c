@@ -0,0 +1,306 @@
+/*
+ * cul_gateway: read culfw devices and hand the messages to fhem through
+ * the shared memory ring in cul_shmring.h
+ * License: GPL v2
+ *
+ * Started by 98_CULGateway.pm, which creates the eventfd and passes its
+ * number with -e. Each received line is stored as a binary record: the
+ * type character, the hex payload as bytes, the RSSI byte split off (-r,
+ * culfw X21), the receiver index and the time of reception. Lines which
+ * are not hex (command replies) are stored as they are with SHMR_F_RAW.
+ *
+ * usage:
+ *   cul_gateway -s <shm file> -e <eventfd> [-r] [-i <init>]... <device>[@<baud>]...
+ *   -i  sent to every device after opening it, e.g. -i X21 -i brt
+ *
+ * build:
+ *   gcc -O2 -Wall -o cul_gateway cul_gateway.c
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+#include "cul_shmring.h"
+
+#define MAXDEV   8
+#define LINELEN  600                    // "b" + 2*255 + rssi + slack
+#define REOPEN   5                      // seconds
+
+#if LINELEN/2 > SHMR_DATALEN
+#error "a record does not hold the payload of a LINELEN line"
+#endif
+
+typedef struct {
+  char *path;
+  speed_t baud;
+  int fd;
+  time_t failed;                        // last open/read error
+  uint16_t len;
+  char line[LINELEN];
+} culdev_t;
+
+static culdev_t dev[MAXDEV];
+static uint8_t ndev;
+static char *init[16];
+static uint8_t ninit;
+static uint8_t with_rssi;
+static int efd = -1;
+static shmr_header_t *ring;
+
+static speed_t
+baudrate(long b)
+{
+  switch(b) {
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 38400:  return B38400;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+  }
+  return 0;
+}
+
+static int
+dev_open(culdev_t *d)
+{
+  struct termios t;
+  uint8_t i;
+
+  d->fd = open(d->path, O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC);
+  if(d->fd < 0)
+    goto err;
+  if(tcgetattr(d->fd, &t) == 0) {
+    cfmakeraw(&t);
+    cfsetispeed(&t, d->baud);
+    cfsetospeed(&t, d->baud);
+    t.c_cflag |= CLOCAL|CREAD;
+    tcsetattr(d->fd, TCSANOW, &t);
+  }
+  for(i = 0; i < ninit; i++) {
+    if(write(d->fd, init[i], strlen(init[i])) < 0 || write(d->fd, "\n", 1) < 0)
+      goto err;
+  }
+  d->len = 0;
+  return 0;
+
+err:
+  fprintf(stderr, "cul_gateway: %s: %s\n", d->path, strerror(errno));
+  if(d->fd >= 0)
+    close(d->fd);
+  d->fd = -1;
+  d->failed = time(0);
+  return -1;
+}
+
+static int
+hexval(char c)
+{
+  if(c >= '0' && c <= '9') return c-'0';
+  if(c >= 'A' && c <= 'F') return c-'A'+10;
+  if(c >= 'a' && c <= 'f') return c-'a'+10;
+  return -1;
+}
+
+// Store one line, returns 1 if a record was published
+static uint8_t
+ring_put(uint8_t receiver, char *line, uint16_t len, struct timeval *tv)
+{
+  uint32_t head = ring->head;
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+  shmr_record_t *r;
+  uint16_t i, n;
+
+  if(len == 0)
+    return 0;
+  if(head - tail >= ring->nrec) {
+    ring->dropped++;
+    return 0;
+  }
+
+  r = SHMR_SLOT(ring, head);
+  r->sec = tv->tv_sec;
+  r->usec = tv->tv_usec;
+  r->type = line[0];
+  r->rssi = 0;
+  r->receiver = receiver;
+  r->flags = 0;
+
+  for(i = 1; i < len; i++)
+    if(hexval(line[i]) < 0)
+      break;
+
+  if(i < len || len < 2) {              // not a message: keep the text
+    if(len-1 > SHMR_DATALEN)
+      goto bad;
+    r->flags = SHMR_F_RAW;
+    r->len = len-1;
+    memcpy(r->data, line+1, len-1);
+
+  } else {
+    n = len-1;
+    if(with_rssi && n >= 2) {           // X21: two hex digits RSSI at the end
+      r->rssi = (hexval(line[len-2])<<4) | hexval(line[len-1]);
+      r->flags |= SHMR_F_RSSI;
+      n -= 2;
+    }
+    if((n+1)/2 > SHMR_DATALEN)
+      goto bad;
+    if(n & 1)
+      r->flags |= SHMR_F_NIBBLE;
+    for(i = 0; i < n; i += 2)
+      r->data[i/2] = (hexval(line[1+i])<<4) | (i+1 < n ? hexval(line[2+i]) : 0);
+    r->len = (n+1)/2;
+  }
+
+  __atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+  return 1;
+
+bad:
+  ring->badlines++;
+  return 0;
+}
+
+static uint8_t
+dev_read(uint8_t nr)
+{
+  culdev_t *d = &dev[nr];
+  char buf[256];
+  struct timeval tv;
+  uint8_t put = 0;
+  ssize_t n, i;
+
+  n = read(d->fd, buf, sizeof(buf));
+  if(n < 0 && (errno == EAGAIN || errno == EINTR))
+    return 0;
+  if(n <= 0) {
+    fprintf(stderr, "cul_gateway: %s: %s\n", d->path, n ? strerror(errno) : "EOF");
+    close(d->fd);
+    d->fd = -1;
+    d->failed = time(0);
+    return 0;
+  }
+
+  gettimeofday(&tv, 0);
+  for(i = 0; i < n; i++) {
+    char c = buf[i];
+    if(c == '\r')
+      continue;
+    if(c == '\n') {
+      if(d->len <= LINELEN)
+        put |= ring_put(nr, d->line, d->len, &tv);
+      d->len = 0;
+      continue;
+    }
+    if(d->len < LINELEN)
+      d->line[d->len++] = c;
+    else if(d->len == LINELEN) {        // skip the rest of this line
+      ring->badlines++;
+      d->len++;
+    }
+  }
+  return put;
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: cul_gateway -s <shm file> -e <eventfd> [-r] [-i <init>]... "
+                  "<device>[@<baud>]...\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  char *shm = 0;
+  struct pollfd pfd[MAXDEV];
+  uint8_t map[MAXDEV];
+  uint64_t one = 1;
+  int c, fd;
+
+  while((c = getopt(argc, argv, "s:e:ri:")) != -1) {
+    switch(c) {
+      case 's': shm = optarg; break;
+      case 'e': efd = atoi(optarg); break;
+      case 'r': with_rssi = 1; break;
+      case 'i': if(ninit < sizeof(init)/sizeof(init[0])) init[ninit++] = optarg; break;
+      default:  usage();
+    }
+  }
+  if(!shm || efd < 0 || optind >= argc || argc-optind > MAXDEV)
+    usage();
+
+  for(; optind < argc; optind++) {
+    culdev_t *d = &dev[ndev++];
+    char *at = strchr(argv[optind], '@');
+    d->path = argv[optind];
+    d->baud = B38400;
+    if(at) {
+      *at = 0;
+      if(!(d->baud = baudrate(atol(at+1)))) {
+        fprintf(stderr, "cul_gateway: unsupported baudrate %s\n", at+1);
+        return 1;
+      }
+    }
+    d->fd = -1;
+  }
+
+  fd = open(shm, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if(fd < 0 || ftruncate(fd, SHMR_SIZE) < 0) {
+    perror(shm);
+    return 1;
+  }
+  ring = mmap(0, SHMR_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(ring == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  close(fd);
+  ring->version = SHMR_VERSION;
+  ring->recsize = SHMR_RECSIZE;
+  ring->nrec = SHMR_RECORDS;
+  __atomic_store_n(&ring->magic, SHMR_MAGIC, __ATOMIC_RELEASE);
+
+  signal(SIGPIPE, SIG_IGN);
+  for(c = 0; c < ndev; c++)
+    dev_open(&dev[c]);
+  if(write(efd, &one, sizeof(one)) < 0)  // ready, fhem opens the ring now
+    return 1;
+
+  for(;;) {
+    uint8_t n = 0, put = 0;
+    time_t now = time(0);
+
+    for(c = 0; c < ndev; c++) {
+      if(dev[c].fd < 0 && now - dev[c].failed >= REOPEN)
+        dev_open(&dev[c]);
+      if(dev[c].fd < 0)
+        continue;
+      pfd[n].fd = dev[c].fd;
+      pfd[n].events = POLLIN;
+      map[n++] = c;
+    }
+
+    if(poll(pfd, n, 1000) < 0 && errno != EINTR)
+      break;
+    for(c = 0; c < n; c++)
+      if(pfd[c].revents)
+        put |= dev_read(map[c]);
+
+    if(put && write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      break;
+    if(getppid() == 1)                  // fhem is gone
+      break;
+  }
+  return 0;
+}
@@ -0,0 +1,621 @@
+/*
+ * cul_pulses: find candidate protocols in culfw monitor captures
+ * License: GPL v2
+ *
+ * A capture is the raw serial output of a CUL in monitor mode with binary
+ * times (X18, REP_MONITOR|REP_BINTIME): 'r' <hightime> 'f' <lowtime> per
+ * pulse, the times as one byte in 16us units (TSCALE of rf_receive.c), and
+ * '.' when rf_receive.c ends a message. Other output (X19: the known
+ * messages as text lines) is skipped.
+ *   stty -F /dev/ttyACM0 38400 raw; echo X18 > /dev/ttyACM0
+ *   cat /dev/ttyACM0 > capture
+ *
+ * Each file is mapped and cut into chunks, worker threads take the chunks
+ * from a shared counter. A chunk starts at the first ". r x f" after its
+ * offset where the '.' ends a frame (not a low time of 46 units inside one)
+ * and ends where the next chunk starts, so no frame is cut. A chunk starts
+ * with the payload hash of the last frame before it, see seed_hash.
+ *
+ * Per frame, the first pulse is taken as sync if it is more than 1.5 times
+ * as long as the average of the others. The other pulses are clustered by
+ * (high, low) within the tolerance, the two most frequent clusters are the
+ * zero (the shorter high) and the one symbol; frames where they cover less
+ * than half of the pulses are irregular. The signature is the number of
+ * bits, the sync and the two symbols; frames with the same payload as the
+ * frame before are counted as repeats, as remotes send a frame several
+ * times.
+ * All pulses also go into a (high, low) histogram, which is clustered at
+ * the end for protocols with more than two symbols (Manchester).
+ *
+ * usage:
+ *   cul_pulses [-t threads] [-c chunk MB] [-T tolerance us] [-n top]
+ *              [-m min frames] <capture>...
+ *
+ * build:
+ *   gcc -O2 -Wall -pthread -o cul_pulses cul_pulses.c
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define TUNIT     16                    // us per time unit
+#define MAXPULSE  512                   // pulses per frame, the rest is dropped
+#define MINPULSE  12                    // shorter frames are noise
+#define MAXBITS   (MAXPULSE-1)
+#define NSIG      16384                 // signatures per table, power of 2
+#define NCLUST    8                     // clusters per frame
+#define QUANT     4                     // signature key granularity, units
+
+typedef struct {
+  uint8_t h, l;
+} pulse_t;
+
+typedef struct {
+  uint16_t nbits;
+  uint8_t sh, sl;                       // sync, 0/0: none
+  uint8_t zh, zl, oh, ol;               // zero and one symbol
+} sigkey_t;
+
+typedef struct {
+  sigkey_t k;
+  uint8_t used;
+  uint64_t frames, repeats, other;      // other: pulses in neither symbol
+  uint64_t sum[6];                      // sh sl zh zl oh ol, for the averages
+  uint16_t exlen;                       // example payload, bits
+  uint8_t ex[MAXBITS/8+1];
+} sig_t;
+
+typedef struct {
+  uint64_t hist[256*256];
+  sig_t sig[NSIG];
+  uint64_t frames, noise, irregular, pulses, truncated, broken, sigfull;
+  uint64_t lasthash;                    // payload of the frame before
+} stats_t;
+
+typedef struct {
+  const uint8_t *buf;
+  size_t lo, start, end;                // lo: start of the chunk before
+} job_t;
+
+typedef struct {                        // a frame with two symbols
+  sigkey_t k;
+  uint32_t avg[6];                      // sh sl zh zl oh ol, unquantized
+  uint16_t other;
+  uint64_t hash;
+  uint8_t bits[MAXBITS/8+1];
+} frame_t;
+
+typedef struct {
+  uint32_t cell;                        // high*256 + low
+  uint64_t cnt;
+} cell_t;
+
+static job_t *jobs;
+static size_t njobs;
+static size_t nextjob;                  // atomic
+static uint8_t tol = 200/TUNIT;
+
+static uint8_t
+quant(uint8_t t)
+{
+  return (t + QUANT/2) / QUANT;
+}
+
+static uint8_t
+near(uint8_t a, uint8_t b)
+{
+  return (a > b ? a-b : b-a) <= tol;
+}
+
+static uint32_t
+sig_hash(const sigkey_t *k)
+{
+  uint32_t h = 2166136261u;
+  const uint8_t *p = (const uint8_t *)k;
+  size_t i;
+  for(i = 0; i < sizeof(*k); i++)
+    h = (h ^ p[i]) * 16777619u;
+  return h;
+}
+
+static sig_t *
+sig_get(stats_t *s, const sigkey_t *k)
+{
+  uint32_t i = sig_hash(k), n;
+  for(n = 0; n < NSIG; n++, i++) {
+    sig_t *e = &s->sig[i & (NSIG-1)];
+    if(!e->used) {
+      e->used = 1;
+      e->k = *k;
+      return e;
+    }
+    if(!memcmp(&e->k, k, sizeof(*k)))
+      return e;
+  }
+  s->sigfull++;
+  return 0;
+}
+
+// Signature, payload and hash of a frame of n > 1 pulses, 0 if it is
+// irregular
+static uint8_t
+frame_sig(frame_t *f, pulse_t *p, uint16_t n)
+{
+  uint16_t i, j, first = 0, nc = 0, c0, c1;
+  uint32_t sum = 0;
+  uint32_t ch[NCLUST], cl[NCLUST], cn[NCLUST];
+  uint8_t sym;
+
+  n--;                                  // the last low is the silence
+  for(i = 1; i < n; i++)
+    sum += p[i].h + p[i].l;
+
+  memset(&f->k, 0, sizeof(f->k));
+  if(2*(uint32_t)(p[0].h + p[0].l)*(n-1) > 3*sum) {
+    f->k.sh = quant(p[0].h);
+    f->k.sl = quant(p[0].l);
+    first = 1;
+  }
+
+  // greedy clustering with running means
+  for(i = first; i < n; i++) {
+    for(j = 0; j < nc; j++)
+      if(near(p[i].h, ch[j]/cn[j]) && near(p[i].l, cl[j]/cn[j]))
+        break;
+    if(j == nc) {
+      if(nc == NCLUST)
+        continue;
+      ch[j] = cl[j] = cn[j] = 0;
+      nc++;
+    }
+    ch[j] += p[i].h;
+    cl[j] += p[i].l;
+    cn[j]++;
+  }
+  if(nc < 2)                            // a preamble or a carrier
+    return 0;
+  for(c0 = 0, j = 1; j < nc; j++)
+    if(cn[j] > cn[c0])
+      c0 = j;
+  for(c1 = c0 ? 0 : 1, j = 0; j < nc; j++)
+    if(j != c0 && cn[j] > cn[c1])
+      c1 = j;
+  if(2*(cn[c0] + cn[c1]) < (uint32_t)(n - first))
+    return 0;                           // no two symbols, only in the histogram
+  if(ch[c1]/cn[c1] < ch[c0]/cn[c0]) {   // zero has the shorter high
+    j = c0; c0 = c1; c1 = j;
+  }
+  f->k.zh = quant(ch[c0]/cn[c0]);
+  f->k.zl = quant(cl[c0]/cn[c0]);
+  f->k.oh = quant(ch[c1]/cn[c1]);
+  f->k.ol = quant(cl[c1]/cn[c1]);
+  f->k.nbits = n - first;
+  f->avg[0] = first ? p[0].h : 0;
+  f->avg[1] = first ? p[0].l : 0;
+  f->avg[2] = ch[c0]/cn[c0];
+  f->avg[3] = cl[c0]/cn[c0];
+  f->avg[4] = ch[c1]/cn[c1];
+  f->avg[5] = cl[c1]/cn[c1];
+  f->other = n - first - cn[c0] - cn[c1];
+
+  // the signature of a repeat may differ by the jitter, the hash does not
+  f->hash = (14695981039346656037ull ^ f->k.nbits) * 1099511628211ull;
+  memset(f->bits, 0, sizeof(f->bits));
+  for(i = first; i < n; i++) {
+    int d0 = abs(p[i].h - (int)f->avg[2]) + abs(p[i].l - (int)f->avg[3]);
+    int d1 = abs(p[i].h - (int)f->avg[4]) + abs(p[i].l - (int)f->avg[5]);
+    sym = d1 < d0;
+    if(sym)
+      f->bits[(i-first)/8] |= 0x80 >> ((i-first)%8);
+    f->hash = (f->hash ^ sym) * 1099511628211ull;
+  }
+  return 1;
+}
+
+static void
+frame_done(stats_t *s, pulse_t *p, uint16_t n)
+{
+  uint16_t i;
+  frame_t f;
+  sig_t *e;
+
+  if(n < MINPULSE) {
+    s->noise++;
+    return;
+  }
+  s->frames++;
+  s->pulses += n;
+  for(i = 0; i < n; i++)
+    s->hist[p[i].h*256 + p[i].l]++;
+  if(!frame_sig(&f, p, n)) {
+    s->irregular++;
+    return;
+  }
+
+  if(!(e = sig_get(s, &f.k)))
+    return;
+  e->frames++;
+  e->other += f.other;
+  for(i = 0; i < 6; i++)
+    e->sum[i] += f.avg[i];
+  if(s->lasthash == f.hash) {
+    e->repeats++;
+    if(!e->exlen) {                     // a repeated frame is a good example
+      e->exlen = f.k.nbits;
+      memcpy(e->ex, f.bits, sizeof(f.bits));
+    }
+  }
+  s->lasthash = f.hash;
+}
+
+// Parse the monitor output from start to end, see the header. Without s
+// only the hash of the last regular frame is kept in *last.
+static void
+scan(stats_t *s, uint64_t *last, const uint8_t *b, size_t i, size_t end)
+{
+  pulse_t p[MAXPULSE];
+  uint16_t n = 0;
+  uint8_t trunc = 0;
+  frame_t f;
+
+  while(i < end) {
+    switch(b[i]) {
+      case 'r':
+        if(i+3 >= end || b[i+2] != 'f') {
+          if(s)
+            s->broken++;                // not X18, or a lost byte
+          i++;
+          continue;
+        }
+        if(n < MAXPULSE) {
+          p[n].h = b[i+1];
+          p[n].l = b[i+3];
+          n++;
+        } else
+          trunc = 1;
+        i += 4;
+        continue;
+      case '.':
+        if(s) {
+          frame_done(s, p, n);
+          s->truncated += trunc;
+        } else if(n >= MINPULSE && frame_sig(&f, p, n))
+          *last = f.hash;
+        n = trunc = 0;
+        break;
+    }
+    i++;
+  }
+}
+
+// A frame starts at off: ". r x f", where the '.' ends a frame. A low time
+// of 46 units inside a frame is a '.' too, but 4 bytes before it is the 'r'
+// and 2 bytes before it the 'f' of its pulse.
+static int
+frame_start(const uint8_t *b, size_t off, size_t size)
+{
+  return off > 0 && off+2 < size && b[off-1] == '.' && b[off] == 'r' && b[off+2] == 'f' &&
+         !(off >= 4 && b[off-4] == 'r' && b[off-2] == 'f');
+}
+
+// First frame start at or after off
+static size_t
+sync_at(const uint8_t *b, size_t off, size_t size)
+{
+  if(off == 0)
+    return 0;
+  for(; off+2 < size; off++)
+    if(frame_start(b, off, size))
+      return off;
+  return size;
+}
+
+// Last frame start in [lo, end), lo if there is none
+static size_t
+sync_before(const uint8_t *b, size_t lo, size_t end)
+{
+  size_t off;
+
+  for(off = end-1; off > lo; off--)
+    if(frame_start(b, off, end))
+      return off;
+  return lo;
+}
+
+// lasthash at the start of a chunk, as scanning the file in one piece
+// would leave it: the last regular frame before it. Searched backwards
+// frame by frame, usually the first one is.
+static uint64_t
+seed_hash(const job_t *jb)
+{
+  size_t q = jb->start, e;
+  uint64_t h = 0;
+
+  while(q > jb->lo) {
+    e = q;
+    q = sync_before(jb->buf, jb->lo, e);
+    scan(0, &h, jb->buf, q, e);
+    if(h)
+      break;
+  }
+  return h;
+}
+
+static void *
+worker(void *arg)
+{
+  stats_t *s = arg;
+  size_t j;
+
+  while((j = __atomic_fetch_add(&nextjob, 1, __ATOMIC_RELAXED)) < njobs) {
+    s->lasthash = seed_hash(&jobs[j]);
+    scan(s, 0, jobs[j].buf, jobs[j].start, jobs[j].end);
+  }
+  return 0;
+}
+
+static int
+cmp_sig(const void *a, const void *b)
+{
+  const sig_t *x = *(sig_t * const *)a, *y = *(sig_t * const *)b;
+  return x->frames < y->frames ? 1 : x->frames > y->frames ? -1 : 0;
+}
+
+// Signatures differing by less than the tolerance, e.g. at a QUANT border,
+// are merged into the most frequent one.
+static uint16_t
+sig_merge(stats_t *t, sig_t **out)
+{
+  sig_t **v = malloc(NSIG * sizeof(*v)), *a, *b;
+  uint32_t i, j, n = 0, m = 0;
+  uint8_t x;
+
+  for(i = 0; i < NSIG; i++)
+    if(t->sig[i].used)
+      v[n++] = &t->sig[i];
+  qsort(v, n, sizeof(*v), cmp_sig);
+
+  for(i = 0; i < n; i++) {
+    b = v[i];
+    for(j = 0; j < m; j++) {
+      a = out[j];
+      if(abs(a->k.nbits - b->k.nbits) > 1 ||
+         !!a->k.sh != !!b->k.sh)
+        continue;
+      for(x = 0; x < 6; x++)
+        if(!near(a->sum[x]/a->frames, b->sum[x]/b->frames))
+          break;
+      if(x == 6)
+        break;
+    }
+    if(j < m) {
+      a = out[j];
+      a->frames += b->frames;
+      a->repeats += b->repeats;
+      a->other += b->other;
+      for(x = 0; x < 6; x++)
+        a->sum[x] += b->sum[x];
+      if(!a->exlen && b->exlen) {
+        a->exlen = b->exlen;
+        memcpy(a->ex, b->ex, sizeof(a->ex));
+      }
+    } else
+      out[m++] = b;
+  }
+  free(v);
+  return m;
+}
+
+static int
+cmp_cell(const void *a, const void *b)
+{
+  const cell_t *x = a, *y = b;
+  if(x->cnt != y->cnt)
+    return x->cnt < y->cnt ? 1 : -1;
+  return x->cell < y->cell ? -1 : x->cell > y->cell;
+}
+
+// Peaks of the (high, low) histogram, in descending order. The cells are
+// sorted by count, each one starts a peak or is counted to the first peak
+// it is near.
+static void
+hist_report(stats_t *t, uint8_t top)
+{
+  uint32_t ch[32], cl[32], i, j, nc = 0, n = 0;
+  uint64_t cn[32];
+  cell_t *c = malloc(256*256 * sizeof(*c));
+
+  if(!c) {
+    perror("malloc");
+    return;
+  }
+  if(top > 32)
+    top = 32;
+  for(i = 0; i < 256*256; i++)
+    if(t->hist[i]) {
+      c[n].cell = i;
+      c[n++].cnt = t->hist[i];
+    }
+  qsort(c, n, sizeof(*c), cmp_cell);
+
+  for(i = 0; i < n; i++) {
+    for(j = 0; j < nc; j++)
+      if(near(c[i].cell>>8, ch[j]) && near(c[i].cell&0xff, cl[j]))
+        break;
+    if(j == nc) {
+      if(nc == top)
+        continue;
+      ch[nc] = c[i].cell>>8;
+      cl[nc] = c[i].cell&0xff;
+      cn[nc++] = 0;
+    }
+    cn[j] += c[i].cnt;
+  }
+  free(c);
+
+  printf("pulse clusters (high/low us, pulses):\n");
+  for(j = 0; j < nc; j++)
+    printf("  %5u/%-5u %10llu %5.1f%%\n", ch[j]*TUNIT, cl[j]*TUNIT,
+           (unsigned long long)cn[j], 100.0*cn[j]/(t->pulses ? t->pulses : 1));
+}
+
+static void
+usage(void)
+{
+  fprintf(stderr, "usage: cul_pulses [-t threads] [-c chunk MB] [-T tolerance us] "
+                  "[-n top] [-m min frames] <capture>...\n");
+  exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+  long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t chunk = 64, total = 0;
+  uint16_t top = 20, nsig;
+  uint64_t minframes = 10;
+  stats_t **st, *t;
+  pthread_t *tid;
+  sig_t **out;
+  int c, f;
+  long i;
+  uint32_t j;
+
+  while((c = getopt(argc, argv, "t:c:T:n:m:")) != -1) {
+    switch(c) {
+      case 't': nthreads = atol(optarg); break;
+      case 'c': chunk = atol(optarg); break;
+      case 'T': tol = atoi(optarg)/TUNIT; break;
+      case 'n': top = atoi(optarg); break;
+      case 'm': minframes = atoll(optarg); break;
+      default:  usage();
+    }
+  }
+  if(optind >= argc || nthreads < 1 || chunk < 1)
+    usage();
+  chunk <<= 20;
+
+  for(f = optind; f < argc; f++) {
+    struct stat sb;
+    const uint8_t *b;
+    size_t off, n;
+    int fd = open(argv[f], O_RDONLY);
+
+    if(fd < 0 || fstat(fd, &sb) < 0) {
+      perror(argv[f]);
+      return 1;
+    }
+    if(sb.st_size == 0) {
+      close(fd);
+      continue;
+    }
+    b = mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(b == MAP_FAILED) {
+      perror(argv[f]);
+      return 1;
+    }
+    close(fd);
+    madvise((void *)b, sb.st_size, MADV_SEQUENTIAL);
+    total += sb.st_size;
+
+    n = (sb.st_size + chunk-1) / chunk;
+    jobs = realloc(jobs, (njobs+n) * sizeof(*jobs));
+    for(off = 0; off < (size_t)sb.st_size; off += chunk) {
+      job_t *jb = &jobs[njobs++];
+      jb->buf = b;
+      jb->lo = off ? jb[-1].start : 0;
+      jb->start = sync_at(b, off, sb.st_size);
+      jb->end = off+chunk < (size_t)sb.st_size ? sync_at(b, off+chunk, sb.st_size) : (size_t)sb.st_size;
+    }
+  }
+
+  st = calloc(nthreads, sizeof(*st));
+  tid = calloc(nthreads, sizeof(*tid));
+  for(i = 0; i < nthreads; i++) {
+    if(!(st[i] = calloc(1, sizeof(stats_t)))) {
+      perror("calloc");
+      return 1;
+    }
+    if((errno = pthread_create(&tid[i], 0, worker, st[i]))) {
+      perror("pthread_create");
+      return 1;
+    }
+  }
+
+  // sum everything into the first table
+  t = st[0];
+  for(i = 0; i < nthreads; i++) {
+    stats_t *s = st[i];
+    pthread_join(tid[i], 0);
+    if(s == t)
+      continue;
+    for(j = 0; j < 256*256; j++)
+      t->hist[j] += s->hist[j];
+    for(j = 0; j < NSIG; j++) {
+      sig_t *a, *b = &s->sig[j];
+      if(!b->used || !(a = sig_get(t, &b->k)))
+        continue;
+      a->frames += b->frames;
+      a->repeats += b->repeats;
+      a->other += b->other;
+      for(c = 0; c < 6; c++)
+        a->sum[c] += b->sum[c];
+      if(!a->exlen && b->exlen) {
+        a->exlen = b->exlen;
+        memcpy(a->ex, b->ex, sizeof(a->ex));
+      }
+    }
+    t->frames += s->frames;
+    t->noise += s->noise;
+    t->irregular += s->irregular;
+    t->pulses += s->pulses;
+    t->truncated += s->truncated;
+    t->broken += s->broken;
+    t->sigfull += s->sigfull;
+    free(s);
+  }
+
+  printf("%zu bytes, %zu chunks, %ld threads\n", total, njobs, nthreads);
+  printf("%llu frames, %llu noise, %llu irregular, %llu pulses, %llu truncated, %llu broken, "
+         "%llu unsorted\n",
+         (unsigned long long)t->frames, (unsigned long long)t->noise,
+         (unsigned long long)t->irregular,
+         (unsigned long long)t->pulses, (unsigned long long)t->truncated,
+         (unsigned long long)t->broken, (unsigned long long)t->sigfull);
+  hist_report(t, 12);
+
+  out = malloc(NSIG * sizeof(*out));
+  nsig = sig_merge(t, out);
+  printf("candidate protocols (us):\n");
+  printf("  %10s %10s %4s %11s %11s %11s %6s  %s\n",
+         "frames", "repeats", "bits", "sync", "zero", "one", "other", "example");
+  for(j = 0; j < nsig && j < top; j++) {
+    sig_t *e = out[j];
+    char s[16];
+    uint16_t x;
+    if(e->frames < minframes)
+      break;
+    if(e->k.sh)
+      snprintf(s, sizeof(s), "%u/%u", (unsigned)(e->sum[0]/e->frames*TUNIT),
+               (unsigned)(e->sum[1]/e->frames*TUNIT));
+    else
+      strcpy(s, "-");
+    printf("  %10llu %10llu %4u %11s %5u/%-5u %5u/%-5u %5.1f%%  ",
+           (unsigned long long)e->frames, (unsigned long long)e->repeats,
+           e->k.nbits, s,
+           (unsigned)(e->sum[2]/e->frames*TUNIT), (unsigned)(e->sum[3]/e->frames*TUNIT),
+           (unsigned)(e->sum[4]/e->frames*TUNIT), (unsigned)(e->sum[5]/e->frames*TUNIT),
+           100.0*e->other/(e->frames*(uint64_t)e->k.nbits));
+    for(x = 0; x < (e->exlen+7)/8; x++)
+      printf("%02X", e->ex[x]);
+    printf("%s\n", e->exlen ? "" : "-");
+  }
+  return 0;
+}
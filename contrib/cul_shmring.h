@@ -0,0 +1,71 @@
+/*
+ * Shared memory ring between cul_gateway and 98_CULGateway.pm
+ * License: GPL v2
+ *
+ * Single producer (the gateway), single consumer (fhem). The file, usually
+ * in /dev/shm, starts with a header page, followed by SHMR_RECORDS fixed
+ * size records. head is only written by the producer, tail only by the
+ * consumer, each on its own cache line. Both count records, modulo 2^32;
+ * the slot is (count & (nrec-1)).
+ *
+ * The producer fills the slot, then publishes it with a release store of
+ * head and writes 1 to the eventfd. The consumer reads the eventfd, takes
+ * all records up to head and stores tail. A full ring drops the new record
+ * and counts it in dropped.
+ *
+ * All fields are little endian, the layout is fixed so the Perl side can
+ * read it with unpack:
+ *   header  V v v V V   magic version recsize nrec flags  (offset 0)
+ *           V V V       head dropped badlines             (offset 64)
+ *           V           tail                              (offset 128)
+ *   record  V V C C C C v a*                              (offset 4096 + slot*recsize)
+ *           sec usec type rssi receiver flags len data
+ */
+#ifndef _CUL_SHMRING_H
+#define _CUL_SHMRING_H
+
+#include <stdint.h>
+
+#define SHMR_MAGIC      0x52485343      // "CSHR"
+#define SHMR_VERSION    1
+#define SHMR_RECORDS    1024            // power of 2
+#define SHMR_RECSIZE    320             // the hex payload of a LINELEN line
+#define SHMR_DATALEN    (SHMR_RECSIZE-14)
+#define SHMR_HDRSIZE    4096
+
+// record flags
+#define SHMR_F_NIBBLE   0x01            // the low nibble of the last byte is unused (KS300)
+#define SHMR_F_RAW      0x02            // data is the line as received, not hex
+#define SHMR_F_RSSI     0x04            // rssi is valid (culfw X2x)
+
+typedef struct {
+  uint32_t sec, usec;                   // reception time, gettimeofday
+  uint8_t  type;                        // first character of the culfw line
+  uint8_t  rssi;                        // cc1101 RSSI register
+  uint8_t  receiver;                    // index of the serial device
+  uint8_t  flags;
+  uint16_t len;                         // bytes in data
+  uint8_t  data[SHMR_DATALEN];
+} __attribute__((packed)) shmr_record_t;
+
+typedef struct {
+  uint32_t magic;
+  uint16_t version, recsize;
+  uint32_t nrec;
+  uint32_t flags;
+  uint8_t  pad0[64-16];
+
+  volatile uint32_t head;               // producer
+  volatile uint32_t dropped;            // ring full
+  volatile uint32_t badlines;           // too long or not parseable
+  uint8_t  pad1[64-12];
+
+  volatile uint32_t tail;               // consumer
+  uint8_t  pad2[SHMR_HDRSIZE-132];
+} shmr_header_t;
+
+#define SHMR_SIZE       (SHMR_HDRSIZE + SHMR_RECORDS*SHMR_RECSIZE)
+#define SHMR_SLOT(h,n)  ((shmr_record_t *)((uint8_t *)(h) + SHMR_HDRSIZE + \
+                          ((n) & ((h)->nrec-1)) * (h)->recsize))
+
+#endif
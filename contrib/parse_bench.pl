@@ -0,0 +1,346 @@
+#!/usr/bin/perl
+###############################################################################
+#
+# parse_bench.pl: replay received lines through the FHEM Parse functions
+#
+# this script is part of fhem under the same license
+#
+# Loads 32_TechemHKV.pm, 32_TechemWZ.pm and 64_ESA2000.pm against a minimal
+# stub of the fhem.pl globals and feeds every corpus line to the ParseFn of
+# the first module whose Match fits, as Dispatch does. A device is defined
+# for every meter in the corpus (unless -u), so the full path including
+# Receive and the readings functions runs.
+#
+# Passes over the corpus:
+#   1. throughput: telegrams per second, nothing wrapped
+#   2. phases: SanityCheck (incl. CRC), decode (rest of Parse), dispatch
+#      (Receive) and readings (readings*Update) are wrapped and timed
+#      exclusively; the wrappers add some overhead to this pass
+#   3. with -p: what 98_ParsePool moves out of fhem against what it adds,
+#      run before 2. so the decode is not wrapped
+# Memory is reported as VmRSS growth and VmHWM from /proc/self/status.
+#
+# usage:
+#   parse_bench.pl [-d <fhem dir>] [-n 5] [-g 10000] [-u] [-p] [corpus ...]
+#   -d  directory with the modules, default: the parent of contrib
+#   -n  passes over the corpus for each measurement
+#   -g  add this many synthetic Techem lines (techem_sim.pl) and ESA lines
+#   -u  do not define devices, measure the unknown/neighbour path
+#   -p  per module: <module>_Decode inline against the fhem side cost of
+#       handing it to a 98_ParsePool worker (request, reply, thaw), CPU
+#       time of this process only
+#   corpus: files with one line per message, "b...::<rssi>" or "S..."
+#           as passed to Dispatch; empty lines and # comments are skipped
+#
+###############################################################################
+
+package main;
+
+use strict;
+use warnings;
+
+use File::Basename;
+use File::Spec;
+use Getopt::Std;
+use POSIX qw(strftime);
+use Socket;
+use Storable qw(nfreeze thaw);
+use Time::HiRes qw(time);
+
+use vars qw(%modules %defs %attr %data $readingFnAttributes $init_done);
+
+my %opts;
+getopts('d:n:g:up', \%opts) or die "usage: see the head of $0\n";
+my $dir    = File::Spec->rel2abs($opts{d} || dirname(__FILE__).'/..');
+my $passes = $opts{n} || 5;
+my $synth  = $opts{g} || 0;
+
+###############################################################################
+# fhem.pl stub
+
+$readingFnAttributes = "event-on-change-reading event-on-update-reading";
+$init_done = 0;
+
+sub Log($$) {}
+sub Log3($$$) {}
+sub AssignIoPort($;$) {}
+sub InternalTimer($$$;$) {}
+sub RemoveInternalTimer($;$) {}
+sub IsIgnored($) { return 0; }
+sub TimeNow() { return strftime("%Y-%m-%d %H:%M:%S", localtime(time())); }
+
+sub
+AttrVal($$$) {
+  my ($d, $n, $default) = @_;
+  return (defined($attr{$d}) && defined($attr{$d}{$n})) ? $attr{$d}{$n} : $default;
+}
+
+sub
+ReadingsVal($$$) {
+  my ($d, $n, $default) = @_;
+  return (defined($defs{$d}) && defined($defs{$d}{READINGS}{$n})) ? $defs{$d}{READINGS}{$n}{VAL} : $default;
+}
+
+sub
+ReadingsTimestamp($$$) {
+  my ($d, $n, $default) = @_;
+  return (defined($defs{$d}) && defined($defs{$d}{READINGS}{$n})) ? $defs{$d}{READINGS}{$n}{TIME} : $default;
+}
+
+sub
+readingsBeginUpdate($) {
+  my ($hash) = @_;
+  $hash->{".updateTimestamp"} = TimeNow();
+  $hash->{CHANGED} = [] unless (defined($hash->{CHANGED}));
+}
+
+sub
+readingsBulkUpdate($$$;$) {
+  my ($hash, $reading, $value) = @_;
+  $value = '' unless (defined($value));
+  $hash->{READINGS}{$reading}{VAL} = $value;
+  $hash->{READINGS}{$reading}{TIME} = $hash->{".updateTimestamp"};
+  push @{$hash->{CHANGED}}, ($reading eq 'state') ? $value : "$reading: $value";
+  return $value;
+}
+
+sub
+readingsEndUpdate($$) {
+  my ($hash) = @_;
+  # DoTrigger would run the notifies here
+  delete $hash->{CHANGED};
+  delete $hash->{CHANGETIME};
+  delete $hash->{".updateTimestamp"};
+}
+
+sub
+readingsSingleUpdate($$$$) {
+  my ($hash, $reading, $value, $dotrigger) = @_;
+  readingsBeginUpdate($hash);
+  readingsBulkUpdate($hash, $reading, $value);
+  readingsEndUpdate($hash, $dotrigger);
+}
+
+###############################################################################
+
+# fhem has modpath/FHEM in @INC, for "use TechemUtils;"
+unshift @INC, $dir;
+my @mods = qw(TechemHKV TechemWZ ESA2000);
+foreach my $f (qw(32_TechemHKV.pm 32_TechemWZ.pm 64_ESA2000.pm)) {
+  my $r = do "$dir/$f";
+  die "$f: $@" if ($@);
+  die "$f: $!" unless (defined($r));
+}
+foreach my $m (@mods) {
+  no strict 'refs';
+  $modules{$m} = { defptr => {} };
+  &{"${m}_Initialize"}($modules{$m});
+}
+# done by the first Define, needed without devices too
+$data{WMBUS}{crc_table_13757} = TechemHKV_createCrcTable();
+
+my @corpus;
+foreach my $f (@ARGV) {
+  open(my $fh, '<', $f) or die "$f: $!\n";
+  while (my $l = <$fh>) {
+    $l =~ s/[\r\n]+$//;
+    push @corpus, $l if ($l =~ m/^[A-Za-z]/);
+  }
+  close($fh);
+}
+if ($synth) {
+  my $sim = dirname(__FILE__).'/techem_sim.pl';
+  open(my $fh, '-|', $^X, $sim, '-r', 0, '-c', $synth, '-n', int($synth / 4) + 1, '-f', 'dispatch')
+    or die "$sim: $!\n";
+  while (my $l = <$fh>) {
+    chomp($l);
+    push @corpus, $l;
+  }
+  close($fh);
+  # ESA2000 WZ: S <seq> <dev> 011E <total ticks> <ticks> 000000 <imp/kWh>
+  for (my $i = 0; $i < $synth / 4; $i++) {
+    my $dev = 0x1000 + $i % 256;
+    push @corpus, sprintf("S%02X%04X011E%08X%04X000000%04X", $i % 128, $dev,
+                          1000 + $i * 7, $i % 50, 2000 ^ ($dev >> 8));
+  }
+}
+die "empty corpus, give files or -g\n" unless (@corpus);
+
+# the first module whose Match fits, as Dispatch
+my @route;
+my %count;
+foreach my $l (@corpus) {
+  my $m = (grep { $l =~ m/$modules{$_}{Match}/ } @mods)[0];
+  push @route, $m;
+  $count{defined($m) ? $m : 'unmatched'}++;
+}
+
+if (!$opts{u}) {
+  my $n = 0;
+  for (my $i = 0; $i < @corpus; $i++) {
+    my $m = $route[$i];
+    next unless (defined($m));
+    my $id;
+    if ($m eq 'ESA2000') {
+      $id = lc(substr($corpus[$i], 3, 4));
+    } else {
+      $id = join('', reverse(substr($corpus[$i], 9, 8) =~ m/(..)/g));
+    }
+    next if (defined($modules{$m}{defptr}{$id}));
+    my $name = "bench_".$n++;
+    my $hash = { NAME => $name, TYPE => $m, NR => $n };
+    $defs{$name} = $hash;
+    no strict 'refs';
+    my $err = &{$modules{$m}{DefFn}}($hash, "$name $m $id");
+    die "define $name $m $id: $err\n" if ($err);
+  }
+}
+
+my $io = { NAME => 'benchCUL', TYPE => 'CUL', RSSI => -70 };
+
+sub
+Replay() {
+  no strict 'refs';
+  for (my $i = 0; $i < @corpus; $i++) {
+    my $m = $route[$i];
+    next unless (defined($m));
+    &{$modules{$m}{ParseFn}}($io, $corpus[$i]);
+  }
+}
+
+sub
+Mem() {
+  my %m;
+  open(my $fh, '<', '/proc/self/status') or return (0, 0);
+  while (<$fh>) {
+    $m{$1} = $2 if (m/^(VmRSS|VmHWM):\s+(\d+)/);
+  }
+  close($fh);
+  return ($m{VmRSS} || 0, $m{VmHWM} || 0);
+}
+
+printf("corpus: %d lines (%s)\n", scalar(@corpus),
+       join(', ', map { "$_ $count{$_}" } sort keys %count));
+printf("devices: %d\n", scalar(keys %defs));
+
+# warm up: first readings, caches, hash growth
+my ($rss0) = Mem();
+Replay();
+my ($rss1) = Mem();
+
+# pass 1: throughput
+my $t0 = time();
+Replay() for (1 .. $passes);
+my $dt = time() - $t0;
+my $n = $passes * (@corpus - ($count{unmatched} || 0));
+printf("throughput: %.0f telegrams/s (%.1f us/telegram, %d telegrams in %.3fs)\n",
+       $n / $dt, $dt * 1e6 / $n, $n, $dt);
+
+# pass 3: inline decode against the IPC of 98_ParsePool. The child echoes
+# the frames, a request carries the frozen decoded message so the reply has
+# its real size. Pipelined in batches like the pool, only the CPU time of
+# this process counts: the worker runs on another core.
+if ($opts{p}) {
+  my ($parent, $child);
+  socketpair($parent, $child, AF_UNIX, SOCK_STREAM, PF_UNSPEC) or die "socketpair: $!\n";
+  my $pid = fork();
+  die "fork: $!\n" unless (defined($pid));
+  if ($pid == 0) {
+    close($parent);
+    my $buf;
+    while (sysread($child, $buf, 65536)) {
+      while (length($buf)) {
+        my $w = syswrite($child, $buf);
+        POSIX::_exit(1) unless (defined($w));
+        substr($buf, 0, $w) = '';
+      }
+    }
+    POSIX::_exit(0);
+  }
+  close($child);
+  print "pool (CPU us/telegram in fhem):\n";
+  printf("  %-9s %8s %8s\n", '', 'inline', 'ipc');
+  foreach my $m (@mods) {
+    my @l = map { $corpus[$_] } grep { defined($route[$_]) && ($route[$_] eq $m) } (0 .. $#corpus);
+    next unless (@l);
+    no strict 'refs';
+    my $dec = \&{"${m}_Decode"};
+    my @r = map { nfreeze([$m, 'benchCUL', scalar($dec->($_))]) } @l;
+    my $c0 = (times())[0];
+    for (1 .. $passes) {
+      $dec->($_) foreach (@l);
+    }
+    my $inline = (times())[0] - $c0;
+    $c0 = (times())[0];
+    for (1 .. $passes) {
+      for (my $i = 0; $i < @l; $i += 64) {
+        my $e = ($i + 64 < @l) ? $i + 64 : scalar(@l);
+        # fhem side of the request: frame it, write it
+        my $out = join('', map { pack('N/a*', "$m\0benchCUL\0$l[$_]\0".$r[$_]) } ($i .. $e - 1));
+        while (length($out)) {
+          my $w = syswrite($parent, $out);
+          die "write: $!\n" unless (defined($w));
+          substr($out, 0, $w) = '';
+        }
+        # fhem side of the reply: read, unframe, thaw
+        my ($in, $got) = ('', $i);
+        while ($got < $e) {
+          sysread($parent, $in, 65536, length($in)) or die "read: $!\n";
+          while (length($in) >= 4) {
+            my $len = unpack('N', $in);
+            last if (length($in) < 4 + $len);
+            my $f = substr($in, 4, $len);
+            substr($in, 0, 4 + $len) = '';
+            thaw(substr($f, index($f, "\0", index($f, "\0", length($m) + 1) + 1) + 1));
+            $got++;
+          }
+        }
+      }
+    }
+    my $ipc = (times())[0] - $c0;
+    my $k = $passes * @l;
+    printf("  %-9s %8.2f %8.2f\n", $m, $inline * 1e6 / $k, $ipc * 1e6 / $k);
+  }
+  close($parent);
+  waitpid($pid, 0);
+}
+
+# pass 2: exclusive time per phase
+my (%phase, @stack);
+sub
+Wrap($$) {
+  my ($fn, $ph) = @_;
+  no strict 'refs';
+  no warnings qw(redefine prototype);
+  return unless (defined(&{"main::$fn"}));
+  my $orig = \&{"main::$fn"};
+  *{"main::$fn"} = sub {
+    push @stack, 0;
+    my $t = time();
+    my @r = wantarray ? $orig->(@_) : scalar($orig->(@_));
+    $t = time() - $t;
+    my $child = pop @stack;
+    $phase{$ph} += $t - $child;
+    $stack[-1] += $t if (@stack);
+    return wantarray ? @r : $r[0];
+  };
+}
+foreach my $m (@mods) {
+  Wrap("${m}_Parse", 'decode');
+  Wrap("${m}_SanityCheck", 'sanity');
+  Wrap("${m}_Receive", 'dispatch');
+}
+Wrap($_, 'readings') foreach (qw(readingsBeginUpdate readingsBulkUpdate readingsEndUpdate readingsSingleUpdate));
+
+Replay() for (1 .. $passes);
+my $sum = 0;
+$sum += $_ foreach (values %phase);
+print "phases (exclusive, wrapped):\n";
+foreach my $ph (qw(sanity decode dispatch readings)) {
+  my $v = $phase{$ph} || 0;
+  printf("  %-9s %8.2f us/telegram %5.1f%%\n", $ph, $v * 1e6 / $n, $sum ? 100 * $v / $sum : 0);
+}
+
+my ($rss2, $hwm) = Mem();
+printf("memory: VmRSS %d kB after load, +%d kB warm up, +%d kB measuring, VmHWM %d kB\n",
+       $rss0, $rss1 - $rss0, $rss2 - $rss1, $hwm);
@@ -0,0 +1,196 @@
+#!/usr/bin/perl
+###############################################################################
+#
+# techem_sim.pl: generate Techem WMBus telegrams for load tests
+#
+# this script is part of fhem under the same license
+#
+# Writes "b..." lines as a CUL in WMBus_T mode would, for HKV versions
+# 61/64/69/94 (32_TechemHKV) and WZ types 43/45/62/72 (32_TechemWZ). Every
+# telegram carries the EN13757 block CRCs checked by *_SanityCheck: the
+# first 10 bytes, then blocks of 16 bytes, then the rest, each followed by
+# its CRC. IDs are numbered from -i, meter values grow with every telegram,
+# dates are today (current period) and the last 31.12. (billing period).
+#
+# usage:
+#   techem_sim.pl [-n 1000] [-t hkv69,wz62,...] [-r 10] [-c 0] [-i 10000000]
+#                 [-s 1] [-f serial|dispatch] [-o out]
+#   -n  number of meters, spread over the types
+#   -t  meter types, default all: hkv61 hkv64 hkv69 hkv94 wz43 wz45 wz62 wz72
+#   -r  telegrams per second, 0: as fast as possible
+#   -c  number of telegrams, 0: endless
+#   -i  first meter ID (8 digits)
+#   -s  random seed
+#   -f  serial: "b...\r\n" as sent by the CUL, to be read by CUL.pm
+#       dispatch: "b...::<rssi>" as passed to the ParseFn
+#   -o  output file or pty, default stdout. For a pty pair use e.g.
+#       socat -d -d pty,raw,echo=0 pty,raw,echo=0 and point the CUL at the
+#       other end.
+#
+###############################################################################
+
+use strict;
+use warnings;
+
+use Getopt::Std;
+use Time::HiRes qw(time sleep);
+
+my %opts;
+getopts('n:t:r:c:i:s:f:o:', \%opts) or die "usage: see the head of $0\n";
+
+my $count   = defined($opts{n}) ? $opts{n} : 1000;
+my @types   = split(/,/, $opts{t} || 'hkv61,hkv64,hkv69,hkv94,wz43,wz45,wz62,wz72');
+my $rate    = defined($opts{r}) ? $opts{r} : 10;
+my $total   = $opts{c} || 0;
+my $firstId = defined($opts{i}) ? $opts{i} : 10000000;
+my $format  = $opts{f} || 'serial';
+srand(defined($opts{s}) ? $opts{s} : 1);
+
+foreach my $t (@types) {
+  die "unknown type $t\n" unless ($t =~ m/^(?:hkv(?:61|64|69|94)|wz(?:43|45|62|72))$/);
+}
+die "unknown format $format\n" unless ($format =~ m/^(?:serial|dispatch)$/);
+die "IDs must have 8 digits\n" if ($firstId + $count - 1 > 99999999);
+
+my $out = \*STDOUT;
+if (defined($opts{o})) {
+  open($out, '>', $opts{o}) or die "cannot open $opts{o}: $!\n";
+}
+binmode($out);
+$out->autoflush(1);
+
+###############################################################################
+# EN13757 CRC, as in TechemHKV_crc16_13757
+
+my @crcTable;
+for (my $i = 0; $i < 256; $i++) {
+  my $c = ($i << 8);
+  for (my $j = 0; $j < 8; $j++) {
+    $c = ($c & 0x8000) ? (0xFFFF & (($c << 1) ^ 0x3D65)) : (0xFFFF & ($c << 1));
+  }
+  $crcTable[$i] = $c;
+}
+
+sub
+Crc(@) {
+  my $crc = 0;
+  foreach my $b (@_) {
+    $crc = 0xFFFF & (($crc << 8) ^ $crcTable[(($crc >> 8) ^ $b) & 0xFF]);
+  }
+  return $crc ^ 0xFFFF;
+}
+
+# frame bytes (without L) to the hex line with L and block CRCs
+sub
+Frame(@) {
+  my @f = (scalar(@_), @_);
+  my $hex = '';
+  my @blk = splice(@f, 0, 10);
+  while (@blk) {
+    my $crc = Crc(@blk);
+    $hex .= join('', map { sprintf('%02X', $_) } @blk);
+    $hex .= sprintf('%02X%02X', $crc >> 8, $crc & 0xFF);
+    @blk = splice(@f, 0, 16);
+  }
+  return "b$hex";
+}
+
+###############################################################################
+# meter payloads, offsets as read by TechemHKV_Parse / TechemWZ_Parse
+# (byte 0 is the C field, the L field is added by Frame)
+
+my @lt = localtime(time());
+my ($day, $month, $year) = ($lt[3], $lt[4] + 1, $lt[5] % 100);
+# last billing date: 31.12. of last year
+my $lastDate = (($year - 1) << 9) | (12 << 5) | 31;
+
+sub
+LE(@) {
+  my ($v, $n) = @_;
+  return map { ($v >> (8 * $_)) & 0xFF } (0 .. $n - 1);
+}
+
+sub
+Header(@) {
+  my ($m, $version, $type) = @_;
+  # C=44 M=6850 (Techem), ID as BCD little endian
+  my @id = map { hex($_) } reverse(sprintf('%08d', $m->{id}) =~ m/(..)/g);
+  return (0x44, 0x68, 0x50, @id, $version, $type);
+}
+
+sub
+History(@) {
+  my ($m) = @_;
+  return map { $m->{hist}->[$_] } (0 .. 23);
+}
+
+sub
+Hkv(@) {
+  my ($m) = @_;
+  my ($version) = ($m->{type} =~ m/(\d+)$/);
+  my @p = Header($m, hex($version), 0x80);
+  push @p, 0xA0, 0x00;                                   # debug (CI, status)
+  push @p, LE($lastDate, 2), LE($m->{last}, 2);
+  push @p, LE(($month << 9) | ($day << 4), 2), LE($m->{actual}, 2);
+  if ($version eq '69' || $version eq '94') {
+    my ($t1, $t2) = (2000 + int(rand(300)), 1800 + int(rand(300)));
+    push @p, 0x00 if ($version eq '94');                 # temp1 at 20, not 19
+    push @p, LE($t1, 2), LE($t2, 2);
+    push @p, $m->{hist}->[0], 0x00, 0x00, History($m);   # factor 1
+  }
+  push @p, int(rand(256)) while (@p < 51);
+  return @p;
+}
+
+sub
+Wz(@) {
+  my ($m) = @_;
+  my ($type) = ($m->{type} =~ m/(\d+)$/);
+  my @p = Header($m, 0x74, hex($type));
+  push @p, 0xA0, 0x00;
+  push @p, LE($lastDate, 2);
+  if ($type eq '62' || $type eq '72') {
+    push @p, LE($m->{last}, 2);
+    push @p, LE(($month << 9) | ($day << 4), 2), LE($m->{actual}, 2);
+  } else {
+    push @p, LE($m->{last}, 3), $month << 3, LE($m->{actual}, 3);
+    push @p, LE($day << 7, 2);
+  }
+  push @p, 0x00 while (@p < 23);
+  push @p, History($m);
+  push @p, int(rand(256)) while (@p < 51);
+  return @p;
+}
+
+###############################################################################
+
+my @meters;
+for (my $i = 0; $i < $count; $i++) {
+  my $t = $types[$i % @types];
+  push @meters, {
+    id     => $firstId + $i,
+    type   => $t,
+    last   => 500 + int(rand(5000)),
+    actual => int(rand(2000)),
+    hist   => [ map { int(rand(200)) } (0 .. 23) ],
+  };
+}
+
+my $sent = 0;
+my $start = time();
+while (!$total || $sent < $total) {
+  my $m = $meters[int(rand(@meters))];
+  $m->{actual} += int(rand(5));
+  $m->{actual} &= 0xFFFF;
+  my $line = Frame(($m->{type} =~ m/^hkv/) ? Hkv($m) : Wz($m));
+  if ($format eq 'serial') {
+    print $out "$line\r\n";
+  } else {
+    print $out "$line\:\:".(-40 - int(rand(60)))."\n";
+  }
+  $sent++;
+  if ($rate) {
+    my $wait = $start + $sent / $rate - time();
+    sleep($wait) if ($wait > 0);
+  }
+}